@@ -0,0 +1,430 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <string>
+#include <thread>
+
+#include <opencv2/imgproc.hpp>
+
+#include <motion_tracker/camera/replay_camera.h>
+#include <motion_tracker/frame_pyramid.h>
+#include <motion_tracker/lk_engine.h>
+#include <motion_tracker/feature_detector.h>
+#include <motion_tracker/motion_estimation.h>
+#include <motion_tracker/motion_kernels.h>
+#include <motion_tracker/optic_flow_tracker.h>
+
+#include <cpp-toolkit/thread_pool.h>
+
+// Offline benchmarks of the tracking building blocks over a replayed recording.
+//
+// Usage: benchmark <recording> [<max frames>]
+
+using Clock = std::chrono::steady_clock;
+
+static double secondsSince(const Clock::time_point& start)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count() / 1000000.0;
+}
+
+// Tracks the same corners of consecutive frames with both LK engines, and compares their
+//  throughput and the flow vectors they produce.
+static void benchmarkLkEngines(const std::vector<std::shared_ptr<FramePyramid>>& pyramids, size_t num_points, ThreadPool& workers, size_t num_workers)
+{
+  const cv::Size window_size(OpticFlowTracker::window_size, OpticFlowTracker::window_size);
+  const int max_level = OpticFlowTracker::pyramid_levels;
+  const cv::TermCriteria criteria((cv::TermCriteria::COUNT) + (cv::TermCriteria::EPS), 20, 0.05);
+
+  printf("LK engines, window %d, %d level(s), specialized kernels: %s (%s)\n", window_size.width, max_level,
+    hasSpecializedKernel(window_size, max_level) ? "available" : "not available", specializedKernelInstructionSet());
+
+  std::vector<std::vector<cv::Point2f>> start_points(pyramids.size());
+  for (size_t i = 0; i + 1 < pyramids.size(); ++i)
+  {
+    cv::goodFeaturesToTrack(pyramids[i]->frame().data(), start_points[i], num_points, 0.00001, 10);
+  }
+
+  double time_opencv = 0;
+  double time_specialized = 0;
+  double time_parallel = 0;
+  size_t tracked = 0;
+
+  size_t status_mismatches = 0;
+  size_t compared = 0;
+  double sum_difference = 0;
+  double max_difference = 0;
+
+  std::vector<cv::Point2f> points_opencv, points_specialized, points_parallel;
+  std::vector<uchar> status_opencv, status_specialized, status_parallel;
+  size_t parallel_mismatches = 0;
+
+  for (size_t i = 0; i + 1 < pyramids.size(); ++i)
+  {
+    if (start_points[i].empty())
+    {
+      continue;
+    }
+
+    auto start = Clock::now();
+    trackPoints(LkEngine::OpenCV, *pyramids[i], *pyramids[i + 1], start_points[i], points_opencv, status_opencv, window_size, max_level, criteria);
+    time_opencv += secondsSince(start);
+
+    start = Clock::now();
+    trackPoints(LkEngine::Specialized, *pyramids[i], *pyramids[i + 1], start_points[i], points_specialized, status_specialized, window_size, max_level, criteria);
+    time_specialized += secondsSince(start);
+
+    start = Clock::now();
+    trackPoints(LkEngine::Specialized, *pyramids[i], *pyramids[i + 1], start_points[i], points_parallel, status_parallel, window_size, max_level, criteria,
+      workers, 32);
+    time_parallel += secondsSince(start);
+
+    tracked += start_points[i].size();
+
+    for (size_t j = 0; j < start_points[i].size(); ++j)
+    {
+      if (status_parallel[j] != status_specialized[j] || points_parallel[j] != points_specialized[j])
+      {
+        ++parallel_mismatches;
+      }
+
+      if (status_opencv[j] != status_specialized[j])
+      {
+        ++status_mismatches;
+      }
+      else if (status_opencv[j])
+      {
+        double difference = cv::norm(points_opencv[j] - points_specialized[j]);
+        sum_difference += difference;
+        max_difference = std::max(max_difference, difference);
+        ++compared;
+      }
+    }
+  }
+
+  if (tracked == 0)
+  {
+    printf("  No points to track!\n");
+    return;
+  }
+
+  printf("  OpenCV:      %8.0f points/s\n", tracked / time_opencv);
+  printf("  Specialized: %8.0f points/s (x%.2f)\n", tracked / time_specialized, time_opencv / time_specialized);
+  printf("  Parallel:    %8.0f points/s (x%.2f, %zu workers), %zu results differ from serial\n",
+    tracked / time_parallel, time_opencv / time_parallel, num_workers, parallel_mismatches);
+  printf("  Status mismatches: %zu of %zu points\n", status_mismatches, tracked);
+  printf("  End point difference: mean %.5f max %.5f [px] over %zu points\n",
+    compared > 0 ? sum_difference / compared : 0.0, max_difference, compared);
+}
+
+// Seeds a full frame the way the tracker does: the frame is split into tiles and every tile is
+//  asked for its share of the points.
+static void replenish(FeatureDetector& detector, const cv::Mat& frame, size_t num_points, std::vector<cv::Point2f>& points,
+  std::vector<cv::Point2f>& found_points)
+{
+  constexpr int tile_size = OpticFlowTracker::detection_tile_size;
+  constexpr float min_distance = OpticFlowTracker::min_corner_distance;
+
+  const int columns = (frame.cols + tile_size - 1) / tile_size;
+  const int rows = (frame.rows + tile_size - 1) / tile_size;
+  const size_t points_per_tile = (num_points + columns * rows - 1) / (columns * rows);
+
+  points.clear();
+  for (int row = 0; row < rows; ++row)
+  {
+    for (int column = 0; column < columns; ++column)
+    {
+      cv::Rect tile = cv::Rect(column * tile_size, row * tile_size, tile_size, tile_size) & cv::Rect(0, 0, frame.cols, frame.rows);
+      detector.detect(frame(tile), points_per_tile, min_distance, found_points);
+
+      for (const auto& pt : found_points)
+      {
+        points.emplace_back(pt.x + tile.x, pt.y + tile.y);
+      }
+    }
+  }
+}
+
+// Compares the corner detectors on how fast they replenish a full frame of points, and on how many
+//  of those points survive being tracked over the following frames.
+static void benchmarkDetectors(const std::vector<std::shared_ptr<FramePyramid>>& pyramids, size_t num_points)
+{
+  constexpr size_t survival_frames = 10;
+
+  const cv::Size window_size(OpticFlowTracker::window_size, OpticFlowTracker::window_size);
+  const cv::TermCriteria criteria((cv::TermCriteria::COUNT) + (cv::TermCriteria::EPS), 20, 0.05);
+
+  printf("Corner detectors, %zu points, survival over %zu frames\n", num_points, survival_frames);
+
+  for (auto type : {FeatureDetector::Type::ShiTomasi, FeatureDetector::Type::Fast, FeatureDetector::Type::Agast})
+  {
+    auto detector = createFeatureDetector(type);
+
+    std::vector<cv::Point2f> seeds, found_points, points, tracked_points;
+    std::vector<uchar> status;
+
+    double detection_time = 0;
+    size_t seeded = 0;
+    size_t survived = 0;
+    size_t runs = 0;
+
+    for (size_t i = 0; i + survival_frames < pyramids.size(); i += survival_frames)
+    {
+      const cv::Mat& frame = pyramids[i]->frame().data();
+
+      auto start = Clock::now();
+      replenish(*detector, frame, num_points, seeds, found_points);
+      detection_time += secondsSince(start);
+      ++runs;
+
+      points = seeds;
+      for (size_t j = i; j < i + survival_frames && !points.empty(); ++j)
+      {
+        trackPoints(LkEngine::OpenCV, *pyramids[j], *pyramids[j + 1], points, tracked_points, status, window_size,
+          OpticFlowTracker::pyramid_levels, criteria);
+
+        points.clear();
+        for (size_t k = 0; k < tracked_points.size(); ++k)
+        {
+          const auto& pt = tracked_points[k];
+          if (status[k] && pt.x >= 0 && pt.y >= 0 && pt.x < frame.cols && pt.y < frame.rows)
+          {
+            points.push_back(pt);
+          }
+        }
+      }
+
+      seeded += seeds.size();
+      survived += points.size();
+    }
+
+    if (runs == 0)
+    {
+      printf("  Too few frames!\n");
+      return;
+    }
+
+    printf("  %-10s: replenish %7.3f [ms], %6.1f corners found, survival %5.1f%%\n", detector->name(),
+      detection_time / runs * 1000, static_cast<double>(seeded) / runs, seeded > 0 ? 100.0 * survived / seeded : 0.0);
+  }
+}
+
+// Tracks a full frame region whose upper half is blanked out, like a plain sky or ceiling, to check
+//  that the tracker still fills its point budget from the textured half, both initially and while
+//  replenishing.
+static void benchmarkTexturelessRegion(const std::vector<std::shared_ptr<FramePyramid>>& pyramids, size_t num_points)
+{
+  std::vector<std::shared_ptr<FramePyramid>> blanked;
+  for (const auto& pyramid : pyramids)
+  {
+    cv::Mat data = pyramid->frame().data().clone();
+    data.rowRange(0, data.rows / 2).setTo(128);
+
+    auto blanked_pyramid = std::make_shared<FramePyramid>(cv::Size(OpticFlowTracker::window_size, OpticFlowTracker::window_size), OpticFlowTracker::pyramid_levels);
+    blanked_pyramid->build(Frame(std::move(data), pyramid->frame().stamp(), Frame::PixelFormat::Gray));
+    blanked.push_back(std::move(blanked_pyramid));
+  }
+
+  const cv::Mat& first = blanked.front()->frame().data();
+  OpticFlowTracker tracker(blanked.front(), Rect<unsigned int>(0, 0, first.cols, first.rows), num_points);
+  size_t initial_points = tracker.numPoints();
+
+  FlowBatch flow;
+  size_t min_vectors = num_points;
+  size_t sum_vectors = 0;
+  for (size_t i = 1; i < blanked.size(); ++i)
+  {
+    tracker.calculate(blanked[i], flow);
+    min_vectors = std::min(min_vectors, flow.size());
+    sum_vectors += flow.size();
+  }
+
+  printf("Half textureless region, %zu points\n", num_points);
+  printf("  Initial points: %zu\n", initial_points);
+  printf("  Flow vectors per frame: min %zu mean %.1f\n", min_vectors, static_cast<double>(sum_vectors) / (blanked.size() - 1));
+}
+
+// The turn rate estimation as it was before the batch kernel: per element double precision asin,
+//  and a full sort for the median.
+static double referenceTurnRate(const CameraConfig& params, const FlowBatch& flow, std::vector<double>& angular_flow)
+{
+  angular_flow.clear();
+  for (size_t i = 0; i < flow.size(); ++i)
+  {
+    double f = asin((2.0*flow.end_x[i] - params.img_width) / params.focal_length) - asin((2.0*flow.start_x[i] - params.img_width) / params.focal_length);
+    if (!std::isnan(f))
+    {
+      angular_flow.push_back(f);
+    }
+  }
+  std::sort(angular_flow.begin(), angular_flow.end());
+
+  return angular_flow.size() < 2 ? 0.0 : angular_flow[angular_flow.size() / 2] / flow.dt;
+}
+
+// Compares the batch turn rate estimation with the reference on synthetic flow: the accuracy of the
+//  polynomial asin, of the resulting turn rates, and the time per batch.
+static void benchmarkTurnRate(const CameraConfig& params)
+{
+  constexpr size_t num_batches = 2000;
+  constexpr size_t batch_size = 200;
+
+  double max_asin_error = 0;
+  for (int i = -100000; i <= 100000; ++i)
+  {
+    float x = i / 100000.f;
+    max_asin_error = std::max(max_asin_error, std::abs(std::asin(static_cast<double>(x)) - fastAsin(x)));
+  }
+
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> position(-0.1f * params.img_width, 1.1f * params.img_width);
+  std::normal_distribution<float> displacement(3, 2);
+
+  std::vector<FlowBatch> batches(num_batches);
+  for (auto& batch : batches)
+  {
+    batch.dt = 1.0 / 30;
+    for (size_t i = 0; i < batch_size; ++i)
+    {
+      float x = position(rng);
+      batch.add(x, 0, x + displacement(rng), 0);
+    }
+  }
+
+  std::vector<double> scratch;
+  std::vector<double> reference(num_batches);
+  auto start = Clock::now();
+  for (size_t i = 0; i < num_batches; ++i)
+  {
+    reference[i] = referenceTurnRate(params, batches[i], scratch);
+  }
+  double time_reference = secondsSince(start);
+
+  std::vector<double> batched(num_batches);
+  start = Clock::now();
+  for (size_t i = 0; i < num_batches; ++i)
+  {
+    batched[i] = getTurnRateFromFlow(params, batches[i]);
+  }
+  double time_batched = secondsSince(start);
+
+  double max_error = 0;
+  for (size_t i = 0; i < num_batches; ++i)
+  {
+    max_error = std::max(max_error, std::abs(reference[i] - batched[i]));
+  }
+
+  printf("Turn rate estimation (%s), %zu batches of %zu vectors\n", motionKernelInstructionSet(), num_batches, batch_size);
+  printf("  asin max error: %.3g [rad]\n", max_asin_error);
+  printf("  Turn rate max error: %.3g [rad/s]\n", max_error);
+  printf("  Reference: %7.3f [us/batch]\n", time_reference / num_batches * 1e6);
+  printf("  Batched:   %7.3f [us/batch] (x%.2f)\n", time_batched / num_batches * 1e6, time_reference / time_batched);
+}
+
+// Times the odometry estimation specialized for a compile time camera model against the generic one.
+static void benchmarkCameraModel(const CameraConfig& params)
+{
+  constexpr size_t num_batches = 2000;
+  constexpr size_t batch_size = 200;
+
+  std::mt19937 rng(2);
+  std::uniform_real_distribution<float> column(0, params.img_width);
+  std::uniform_real_distribution<float> row(0.55f * params.img_height, params.img_height);
+  std::normal_distribution<float> displacement(0, 3);
+
+  std::vector<FlowBatch> rotation(num_batches), translation(num_batches);
+  for (size_t i = 0; i < num_batches; ++i)
+  {
+    rotation[i].dt = translation[i].dt = 1.0 / 30;
+    for (size_t j = 0; j < batch_size; ++j)
+    {
+      float x = column(rng);
+      float y = row(rng);
+      rotation[i].add(x, y, x + displacement(rng), y);
+      translation[i].add(x, y, x + displacement(rng), y + displacement(rng));
+    }
+  }
+
+  OdometryEstimator generic(params, false);
+  OdometryEstimator specialized(params);
+
+  printf("Odometry estimation, %zu batches of 2x%zu vectors, camera model: %s\n", num_batches, batch_size,
+    specialized.usesCameraModel() ? "matched" : "none matches the config");
+
+  std::vector<OdometryEstimate> generic_results(num_batches), specialized_results(num_batches);
+
+  auto start = Clock::now();
+  for (size_t i = 0; i < num_batches; ++i)
+  {
+    generic_results[i] = generic.estimate(rotation[i], translation[i]);
+  }
+  double time_generic = secondsSince(start);
+
+  start = Clock::now();
+  for (size_t i = 0; i < num_batches; ++i)
+  {
+    specialized_results[i] = specialized.estimate(rotation[i], translation[i]);
+  }
+  double time_specialized = secondsSince(start);
+
+  double max_turn_rate_difference = 0;
+  double max_speed_difference = 0;
+  for (size_t i = 0; i < num_batches; ++i)
+  {
+    max_turn_rate_difference = std::max(max_turn_rate_difference, std::abs(generic_results[i].turn_rate - specialized_results[i].turn_rate));
+    max_speed_difference = std::max(max_speed_difference, std::abs(generic_results[i].speed - specialized_results[i].speed));
+  }
+
+  printf("  Generic:     %7.3f [us/batch]\n", time_generic / num_batches * 1e6);
+  printf("  Specialized: %7.3f [us/batch] (x%.2f)\n", time_specialized / num_batches * 1e6, time_generic / time_specialized);
+  printf("  Max difference: turn rate %.3g [rad/s], speed %.3g [m/s]\n", max_turn_rate_difference, max_speed_difference);
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 2)
+  {
+    printf("Usage: %s <recording> [<max frames>]\n", argv[0]);
+    return 1;
+  }
+
+  size_t max_frames = argc > 2 ? std::stoul(argv[2]) : 300;
+
+  CameraConfig camera_conf(85*M_PI/180, 55*M_PI/180, 640, 480, 0*M_PI/180.0, 0, 0.2);
+  benchmarkTurnRate(camera_conf);
+  benchmarkCameraModel(camera_conf);
+
+  ReplayCamera source(camera_conf, argv[1], ReplayCamera::Mode::MaxSpeed);
+
+  // All the pyramids are built up front, so that only the tracking itself is measured
+  std::vector<std::shared_ptr<FramePyramid>> pyramids;
+  while (pyramids.size() < max_frames)
+  {
+    auto frame = source.grab();
+    if (!frame.has_value())
+    {
+      break;
+    }
+
+    auto pyramid = std::make_shared<FramePyramid>(cv::Size(OpticFlowTracker::window_size, OpticFlowTracker::window_size), OpticFlowTracker::pyramid_levels);
+    pyramid->build(frame->toGray());
+    pyramids.push_back(std::move(pyramid));
+  }
+
+  if (pyramids.size() < 2)
+  {
+    printf("The recording has too few frames!\n");
+    return 1;
+  }
+  printf("Loaded %zu frames\n", pyramids.size());
+
+  size_t num_workers = std::max(1u, std::thread::hardware_concurrency());
+  ThreadPool workers(num_workers);
+
+  constexpr size_t num_points = 200;
+  benchmarkLkEngines(pyramids, num_points, workers, num_workers);
+  benchmarkDetectors(pyramids, num_points);
+  benchmarkTexturelessRegion(pyramids, num_points);
+
+  return 0;
+}
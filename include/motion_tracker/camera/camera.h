@@ -6,19 +6,43 @@
 #include <motion_tracker/camera/camera_frame.h>
 #include <motion_tracker/camera/camera_config.h>
 #include <motion_tracker/camera/camera_calibration.h>
+#include <motion_tracker/camera/frame_ring.h>
+#include <motion_tracker/camera/frame_pool.h>
+#include <motion_tracker/camera/frame_source.h>
 
-class Camera
+class Camera : public FrameSource
 {
 public:
   Camera(CameraConfig config, CameraCalibration calibration);
   Camera(CameraConfig config, CameraCalibration calibration, int camera_id);
   Camera(CameraConfig config, CameraCalibration calibration, const std::string& video_src);
-  ~Camera();
+  ~Camera() override;
 
-  std::optional<Frame> grab();
-  const CameraConfig& config() const { return config_; }
+  // Starts a dedicated capture thread which keeps filling a ring of <buffer_size> frames. Once started,
+  //  grab() returns the queued frames in order, and latest() the newest one without waiting for the device.
+  void startCapture(size_t buffer_size, FrameRing::OverflowPolicy policy = FrameRing::OverflowPolicy::DropOldest);
+  void stopCapture();
+
+  // Selects the format of the grabbed frames. In Gray mode the luma plane is taken straight from YUV
+  //  device formats (or converted before any correction), so the correction only touches one channel.
+  //  Must be called before startCapture().
+  void setPixelFormat(Frame::PixelFormat format);
+  Frame::PixelFormat pixelFormat() const;
+
+  std::optional<Frame> grab() override;
+  std::optional<Frame> latest();
+  size_t droppedFrames() const;
+  size_t undecodableFrames() const; // Skipped, as they could not be decoded
+
+  const CameraConfig& config() const override { return config_; }
+  bool stampsCaptureTime() const override { return true; }
+
+  // Buffers of the grabbed frames are recycled through this pool; it can be used for derived frames too.
+  FramePool& pool() override;
 
 private:
+  std::optional<Frame> capture();
+
   struct Internals;
 
   CameraConfig config_;
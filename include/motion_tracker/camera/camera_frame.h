@@ -8,27 +8,38 @@
 #include <chrono>
 
 #include <motion_tracker/camera/camera_config.h>
+#include <motion_tracker/camera/frame_pool.h>
 
 class Frame
 {
 public:
-  using TimeStamp = std::chrono::system_clock::time_point;
+  using TimeStamp = std::chrono::steady_clock::time_point;
+
+  enum class PixelFormat
+  {
+    BGR,
+    Gray
+  };
 
   Frame() {}
-  Frame(cv::Mat src): Frame(std::move(src), std::chrono::system_clock::now()) {}
-  Frame(cv::Mat src, TimeStamp stamp): stamp_(stamp), data_(std::move(src)) {}
+  Frame(cv::Mat src): Frame(std::move(src), std::chrono::steady_clock::now()) {}
+  Frame(cv::Mat src, TimeStamp stamp): stamp_(stamp), format_(src.channels() == 1 ? PixelFormat::Gray : PixelFormat::BGR), data_(std::move(src)) {}
+  Frame(cv::Mat src, TimeStamp stamp, PixelFormat format): stamp_(stamp), format_(format), data_(std::move(src)) {}
 
   [[nodiscard]] Frame toGray() const;
+  [[nodiscard]] Frame toGray(FramePool& pool) const;
   [[nodiscard]] Frame crop(Rect<unsigned int> roi) const { return crop(roi.start_x, roi.start_y, roi.end_x, roi.end_y); }
   [[nodiscard]] Frame crop(unsigned int start_x, unsigned int start_y, unsigned int end_x, unsigned int end_y) const;
 
   const cv::Mat& data() const { return data_; }
   const TimeStamp& stamp() const { return stamp_; }
+  PixelFormat format() const { return format_; }
   bool valid() const { return (data_.rows > 0) && (data_.cols > 0); }
   bool isCompatible(const Frame& other) const { return data_.size() == other.data_.size(); }
 
 private:
   TimeStamp stamp_;
+  PixelFormat format_ = PixelFormat::BGR;
   cv::Mat data_;
 };
 
@@ -0,0 +1,61 @@
+#ifndef FrameLog_h
+#define FrameLog_h
+
+#include <cstdint>
+#include <string>
+#include <optional>
+
+#include <motion_tracker/camera/camera_frame.h>
+
+// On-disk layout of a raw frame log, as written by FrameRecorder:
+//
+//  [FrameLogHeader, padded to data_offset bytes][record 0][record 1]...
+//
+// Every record is a little-endian int64 timestamp [ns] followed by the rows of the frame, tightly packed,
+//  and padded to a multiple of 8 bytes. Only the first <num_frames> records are valid; the rest of
+//  the file is preallocated space.
+struct FrameLogHeader
+{
+  static constexpr char magic_value[8] = {'M', 'V', 'O', 'F', 'L', 'O', 'G', '\0'};
+  static constexpr uint32_t current_version = 1;
+  static constexpr size_t data_offset = 4096;
+
+  char magic[8];
+  uint32_t version;
+
+  int32_t width;
+  int32_t height;
+  int32_t type;           // OpenCV type of the frames (e.g. CV_8UC1)
+
+  uint64_t frame_bytes;   // Pixel data per record
+  uint64_t record_bytes;  // Stamp, pixel data and padding per record
+  uint64_t capacity;      // Number of preallocated records
+  uint64_t num_frames;    // Number of committed records
+};
+
+// Read-only, memory-mapped view of a frame log.
+class FrameLogReader
+{
+public:
+  FrameLogReader(const std::string& file_name);
+  ~FrameLogReader();
+
+  FrameLogReader(const FrameLogReader&) = delete;
+  FrameLogReader& operator=(const FrameLogReader&) = delete;
+
+  bool valid() const { return header_ != nullptr; }
+  size_t numFrames() const;
+
+  Frame::TimeStamp stamp(size_t index) const;
+
+  // Copies the frame at <index> into <dst>, which keeps its buffer if the size and type already match.
+  bool read(size_t index, cv::Mat& dst) const;
+
+private:
+  const uint8_t* record(size_t index) const;
+
+  const FrameLogHeader* header_;
+  size_t mapped_size_;
+};
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef FramePool_h
+#define FramePool_h
+
+#include <mutex>
+#include <vector>
+#include <atomic>
+#include <opencv2/core/mat.hpp>
+
+// Recycling pool of image buffers. A buffer handed out by acquire() is shared through the reference
+//  count of cv::Mat, and goes back to the pool as soon as the last Frame (or Mat) referring to it
+//  is released. Once the pool is warmed up, acquiring a buffer of the same size and type does not allocate.
+class FramePool
+{
+public:
+  FramePool(size_t capacity);
+
+  [[nodiscard]] cv::Mat acquire(const cv::Size& size, int type);
+
+  size_t capacity() const { return capacity_; }
+  size_t misses() const { return misses_.load(); }
+
+private:
+  const size_t capacity_;
+
+  std::mutex lock_;
+  std::vector<cv::Mat> buffers_;
+  std::atomic<size_t> misses_;
+};
+
+#endif
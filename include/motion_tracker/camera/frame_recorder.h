@@ -0,0 +1,36 @@
+#ifndef FrameRecorder_h
+#define FrameRecorder_h
+
+#include <memory>
+#include <string>
+#include <atomic>
+
+#include <motion_tracker/camera/camera_frame.h>
+
+// Records raw frames and their timestamps into an append-only frame log (see frame_log.h), which
+//  can be played back by ReplayCamera.
+//
+// The log file is preallocated for <max_frames> frames on the first recorded frame and is written
+//  through a memory mapping by a background thread. Frames are handed over through a queue of
+//  <queue_depth> frames; when the writer falls behind (or the log is full), frames are dropped and
+//  counted instead of stalling the caller.
+class FrameRecorder
+{
+public:
+  FrameRecorder(const std::string& file_name, size_t max_frames, size_t queue_depth = 8);
+  ~FrameRecorder();
+
+  // Queues <frame> for writing. The frame buffer is shared, not copied, until it is written.
+  void record(const Frame& frame);
+
+  size_t recorded() const { return recorded_.load(); }
+  size_t dropped() const;
+
+private:
+  struct Internals;
+  std::unique_ptr<Internals> internals_;
+
+  std::atomic<size_t> recorded_;
+};
+
+#endif
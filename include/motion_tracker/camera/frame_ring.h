@@ -0,0 +1,51 @@
+#ifndef FrameRing_h
+#define FrameRing_h
+
+#include <mutex>
+#include <vector>
+#include <optional>
+#include <condition_variable>
+
+#include <motion_tracker/camera/camera_frame.h>
+
+// Bounded FIFO of frames handed over from a capture thread to its consumer.
+class FrameRing
+{
+public:
+  enum class OverflowPolicy
+  {
+    DropOldest, // A full ring discards its oldest frame to make room for the new one
+    Block       // A full ring blocks the producer until the consumer catches up
+  };
+
+  FrameRing(size_t capacity, OverflowPolicy policy);
+
+  // Returns false if the ring has been closed and the frame was not stored.
+  bool push(Frame frame);
+
+  // Blocks until a frame is available. Returns std::nullopt once the ring is closed and drained.
+  std::optional<Frame> pop();
+
+  // Returns the newest frame and discards all older ones, without waiting.
+  std::optional<Frame> popLatest();
+
+  void close();
+
+  size_t size() const;
+  size_t dropped() const;
+
+private:
+  std::vector<Frame> frames_;
+  const OverflowPolicy policy_;
+
+  size_t head_;
+  size_t count_;
+  size_t dropped_;
+  bool closed_;
+
+  mutable std::mutex lock_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+};
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef FrameSource_h
+#define FrameSource_h
+
+#include <optional>
+#include <motion_tracker/camera/camera_frame.h>
+#include <motion_tracker/camera/camera_config.h>
+#include <motion_tracker/camera/frame_pool.h>
+
+// Anything that delivers timestamped frames to the odometry pipeline: a live camera or a recording.
+class FrameSource
+{
+public:
+  virtual ~FrameSource() = default;
+
+  // Returns the next frame, or std::nullopt once the source is exhausted.
+  virtual std::optional<Frame> grab() = 0;
+  virtual const CameraConfig& config() const = 0;
+
+  // Pool backing the delivered frames, which can be used for frames derived from them as well.
+  virtual FramePool& pool() = 0;
+
+  // Whether the frames are stamped on the steady clock when they are captured, so that their age
+  //  can be told from their stamps. Recordings keep their recorded stamps instead.
+  virtual bool stampsCaptureTime() const { return false; }
+};
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef ReplayCamera_h
+#define ReplayCamera_h
+
+#include <memory>
+#include <string>
+#include <motion_tracker/camera/frame_source.h>
+
+// Plays back a recorded session, for offline runs without camera hardware.
+//
+// The recording is either a frame log written by FrameRecorder, or a directory of images played in
+//  file name order. If the directory contains a "timestamps.txt" file, each of its lines lists
+//  "<timestamp [us]> <image file name>" and defines both the frames and their order. Otherwise the
+//  frames are stamped at the nominal <frame_rate>.
+//
+// The frame stamps are derived from the recorded timestamps only, so repeated runs over the same
+//  recording see exactly the same time differences. Frames are decoded ahead on a background thread.
+class ReplayCamera : public FrameSource
+{
+public:
+  enum class Mode
+  {
+    RealTime, // Frames are delivered at the recorded rate
+    MaxSpeed  // Frames are delivered as fast as they are consumed
+  };
+
+  ReplayCamera(CameraConfig config, const std::string& path, Mode mode, double frame_rate = 30);
+  ~ReplayCamera() override;
+
+  std::optional<Frame> grab() override;
+  const CameraConfig& config() const override { return config_; }
+  FramePool& pool() override;
+
+  size_t numFrames() const;
+
+private:
+  CameraConfig config_;
+
+  struct Internals;
+  std::unique_ptr<Internals> internals_;
+};
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef CameraModel_h
+#define CameraModel_h
+
+#include <motion_tracker/camera/camera_config.h>
+
+// Compile time descriptions of the camera setups of the fleet. For a known setup the motion
+//  estimation is instantiated with all the constants it derives from the camera (focal length,
+//  trigonometry of the pitch, the pixel to angle scaling) folded in, instead of recomputing them
+//  from a CameraConfig on every frame.
+namespace camera_model
+{
+
+namespace detail
+{
+// Series expansions, accurate to double precision for the angles of camera geometry (|x| < pi/2).
+constexpr double sin(double x)
+{
+  double term = x;
+  double sum = x;
+  for (int n = 1; n < 12; ++n)
+  {
+    term *= -x * x / ((2 * n) * (2 * n + 1));
+    sum += term;
+  }
+  return sum;
+}
+
+constexpr double cos(double x)
+{
+  double term = 1;
+  double sum = 1;
+  for (int n = 1; n < 12; ++n)
+  {
+    term *= -x * x / ((2 * n - 1) * (2 * n));
+    sum += term;
+  }
+  return sum;
+}
+
+constexpr double tan(double x) { return sin(x) / cos(x); }
+
+constexpr double abs(double x) { return x < 0 ? -x : x; }
+}
+
+// <Spec> provides the static constexpr members v_fov, h_fov [rad], img_width, img_height [px],
+//  camera_pitch [rad] and ground_height [m], with the meaning of the CameraConfig fields.
+template<class Spec>
+struct Model
+{
+  static constexpr double img_width = Spec::img_width;
+  static constexpr double img_height = Spec::img_height;
+  static constexpr double ground_height = Spec::ground_height;
+
+  // Same as CameraConfig::calculateFocalLength
+  static constexpr double focal_length = 0.5 * (Spec::img_width / (2 * detail::tan(Spec::h_fov / 2)) + Spec::img_height / (2 * detail::tan(Spec::v_fov / 2)));
+
+  static constexpr double sin_pitch = detail::sin(Spec::camera_pitch);
+  static constexpr double cos_pitch = detail::cos(Spec::camera_pitch);
+
+  static bool matches(const CameraConfig& config)
+  {
+    auto close = [](double a, double b) { return detail::abs(a - b) <= 1e-9 * (detail::abs(a) + detail::abs(b)) + 1e-12; };
+
+    return config.img_width == Spec::img_width && config.img_height == Spec::img_height &&
+      close(config.v_fov, Spec::v_fov) && close(config.h_fov, Spec::h_fov) &&
+      close(config.camera_pitch, Spec::camera_pitch) && close(config.ground_height, Spec::ground_height);
+  }
+};
+
+// The camera setup the app is configured for (see main.cpp).
+struct ForwardVga
+{
+  static constexpr double v_fov = 85 * M_PI / 180;
+  static constexpr double h_fov = 55 * M_PI / 180;
+  static constexpr size_t img_width = 640;
+  static constexpr size_t img_height = 480;
+  static constexpr double camera_pitch = 0;
+  static constexpr double ground_height = 0.2;
+};
+
+}
+
+#endif
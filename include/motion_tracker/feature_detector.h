@@ -0,0 +1,32 @@
+#ifndef FeatureDetector_h
+#define FeatureDetector_h
+
+#include <memory>
+#include <vector>
+#include <opencv2/core/mat.hpp>
+
+// Corner detectors used to seed the tracked points. The tracker buckets the detection into tiles, so
+//  the detectors are only run on small images and asked for a few corners at a time.
+class FeatureDetector
+{
+public:
+  enum class Type
+  {
+    ShiTomasi, // cv::goodFeaturesToTrack, the most selective and the most expensive
+    Fast,      // cv::FAST with non-maximum suppression
+    Agast      // cv::AGAST with non-maximum suppression
+  };
+
+  virtual ~FeatureDetector() = default;
+
+  // Finds at most <max_corners> corners in <image>, the strongest first, which are at least
+  //  <min_distance> apart from each other. With a <mask>, only where it is non-zero.
+  virtual void detect(const cv::Mat& image, size_t max_corners, float min_distance, std::vector<cv::Point2f>& corners,
+    const cv::Mat& mask = cv::Mat()) = 0;
+
+  virtual const char* name() const = 0;
+};
+
+std::unique_ptr<FeatureDetector> createFeatureDetector(FeatureDetector::Type type);
+
+#endif
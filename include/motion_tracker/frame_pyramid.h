@@ -0,0 +1,80 @@
+#ifndef FramePyramid_h
+#define FramePyramid_h
+
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <opencv2/core/mat.hpp>
+
+#include <motion_tracker/camera/camera_frame.h>
+
+// Image pyramid (with gradients) of a full gray frame, in the layout produced by
+//  cv::buildOpticalFlowPyramid, so that it can be passed to cv::calcOpticalFlowPyrLK directly.
+//
+// With a <scale> below 1 the pyramid is built from an area averaged, downscaled copy of the frame,
+//  which is what frame() returns; the coordinates on it are the full frame coordinates multiplied
+//  by scale(). A non zero <refine_window> additionally keeps the single level pyramid of the full
+//  resolution frame, for refining the reduced resolution results.
+class FramePyramid
+{
+public:
+  FramePyramid(cv::Size window_size, int max_level, double scale = 1.0, int refine_window = 0);
+
+  // (Re)builds the pyramid of <gray_frame>, reusing the level buffers of the previous build.
+  void build(const Frame& gray_frame);
+
+  const Frame& frame() const { return frame_; }
+  const std::vector<cv::Mat>& levels() const { return levels_; }
+
+  cv::Size windowSize() const { return window_size_; }
+  int maxLevel() const { return max_level_; }
+  double scale() const { return scale_; }
+
+  // Conversions between the coordinates of frame() and of the full resolution frame, which keep the
+  //  pixel centers aligned the way the area averaging does.
+  cv::Point2f toFullResolution(const cv::Point2f& pt) const { return (pt + cv::Point2f(0.5f, 0.5f)) / scale_ - cv::Point2f(0.5f, 0.5f); }
+  cv::Point2f toReducedResolution(const cv::Point2f& pt) const { return (pt + cv::Point2f(0.5f, 0.5f)) * scale_ - cv::Point2f(0.5f, 0.5f); }
+
+  // Only available for downscaled pyramids built with a refinement window.
+  const Frame& fullFrame() const { return full_frame_; }
+  const std::vector<cv::Mat>& fullLevels() const { return full_levels_; }
+  bool hasFullLevels() const { return !full_levels_.empty(); }
+  int refineWindow() const { return refine_window_; }
+
+private:
+  const cv::Size window_size_;
+  const int max_level_;
+  const double scale_;
+  const int refine_window_;
+
+  Frame frame_;
+  std::vector<cv::Mat> levels_;
+
+  cv::Mat scaled_image_;
+  Frame full_frame_;
+  std::vector<cv::Mat> full_levels_;
+};
+
+// Builds the pyramid of every frame once, to be shared read-only by all the trackers working on it.
+//  Trackers keep a reference to the pyramid of the last frame they processed, so the pyramid of the
+//  previous frame is carried over rather than rebuilt. Pyramids which are no longer referenced are
+//  recycled, so their buffers are reused for the following frames.
+class PyramidCache
+{
+public:
+  PyramidCache(cv::Size window_size, int max_level, size_t capacity = 4, double scale = 1.0, int refine_window = 0);
+
+  [[nodiscard]] std::shared_ptr<const FramePyramid> build(const Frame& gray_frame);
+
+private:
+  const cv::Size window_size_;
+  const int max_level_;
+  const size_t capacity_;
+  const double scale_;
+  const int refine_window_;
+
+  std::mutex lock_;
+  std::vector<std::shared_ptr<FramePyramid>> pyramids_;
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef GroundProjection_h
+#define GroundProjection_h
+
+#include <vector>
+#include <motion_tracker/camera/camera_config.h>
+
+// Maps image points onto the ground plane with precomputed tables instead of trigonometry.
+//
+// The projection is separable: the depth and the forward (y) ground coordinate of a point only
+//  depend on its image row, and the lateral (x) coordinate is the depth scaled by (2*x - width)/f.
+//  The depth has a pole at the horizon row, so instead of the depth its reciprocal is tabulated,
+//  along with the ratio of the forward coordinate to the depth. Both are smooth across the horizon,
+//  on a grid of <subsamples> entries per pixel row, and interpolated linearly in between.
+class GroundProjection
+{
+public:
+  explicit GroundProjection(const CameraConfig& config);
+
+  // Whether the tables were built for the geometry of <config>.
+  bool matches(const CameraConfig& config) const;
+
+  // Ground plane position [m] of the image point (x, y) [px].
+  void project(float x, float y, double& ground_x, double& ground_y) const
+  {
+    double row = y * subsamples;
+    if (row >= 0 && row < last_row_)
+    {
+      size_t index = static_cast<size_t>(row);
+      double t = row - index;
+
+      double depth = 1.0 / (inv_depth_[index] + t * (inv_depth_[index + 1] - inv_depth_[index]));
+      ground_y = depth * (forward_ratio_[index] + t * (forward_ratio_[index + 1] - forward_ratio_[index]));
+      ground_x = depth * (2.0 * x - img_width_) / focal_length_;
+      return;
+    }
+    projectDirect(x, y, ground_x, ground_y);
+  }
+
+private:
+  static constexpr int subsamples = 4;
+
+  // Exact projection, for points outside of the image.
+  void projectDirect(double x, double y, double& ground_x, double& ground_y) const;
+
+  const double img_width_;
+  const double img_height_;
+  const double focal_length_;
+  const double camera_pitch_;
+  const double ground_height_;
+  const double last_row_;
+
+  std::vector<double> inv_depth_;     // 1 / depth
+  std::vector<double> forward_ratio_; // forward / depth
+};
+
+// The projection for <config>, built on first use and rebuilt whenever the geometry changes. The
+//  tables are kept per thread, so concurrent estimators do not contend for them.
+const GroundProjection& groundProjection(const CameraConfig& config);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef LkEngine_h
+#define LkEngine_h
+
+#include <vector>
+#include <opencv2/core/types.hpp>
+
+#include <motion_tracker/frame_pyramid.h>
+#include <cpp-toolkit/thread_pool.h>
+
+enum class LkEngine
+{
+  OpenCV,     // cv::calcOpticalFlowPyrLK
+  Specialized // Fixed-point SIMD kernels, compiled for a fixed set of window sizes and pyramid depths
+};
+
+// Tracks <prev_points> from <prev> into <next> (both full frame coordinates) with pyramidal
+//  Lucas-Kanade. The Specialized engine falls back to OpenCV for configurations it has no kernel for.
+void trackPoints(LkEngine engine, const FramePyramid& prev, const FramePyramid& next,
+  const std::vector<cv::Point2f>& prev_points, std::vector<cv::Point2f>& next_points, std::vector<uchar>& status,
+  cv::Size window_size, int max_level, const cv::TermCriteria& criteria);
+
+// Same as above, with the points split into chunks of <chunk_size> which are tracked in parallel by
+//  the calling thread and <workers>. The results are in the order of <prev_points>.
+void trackPoints(LkEngine engine, const FramePyramid& prev, const FramePyramid& next,
+  const std::vector<cv::Point2f>& prev_points, std::vector<cv::Point2f>& next_points, std::vector<uchar>& status,
+  cv::Size window_size, int max_level, const cv::TermCriteria& criteria,
+  ThreadPool& workers, size_t chunk_size);
+
+bool hasSpecializedKernel(cv::Size window_size, int max_level);
+
+// Name of the instruction set the specialized kernels were compiled for.
+const char* specializedKernelInstructionSet();
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef Metrics_h
+#define Metrics_h
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Latency histograms of the processing stages, cheap enough to be recorded on every frame.
+//
+// Every thread records into its own shard of counters, which only it writes (relaxed atomics, no
+//  read-modify-write), so recording never contends with other threads. The readers merge the shards.
+//
+// The buckets are log-linear like HdrHistogram's: each power of two range of nanoseconds is split
+//  into 16 linear sub-buckets, so any value is known to within 1/16 (~6%) of itself, from 1 ns
+//  up to ~18 minutes.
+namespace metrics
+{
+  enum class Stage
+  {
+    Grab,             // Reading a frame from the device or the recording
+    Undistort,        // Lens and roll correction
+    GrayConversion,
+    CornerDetection,
+    OpticalFlow,      // Lucas-Kanade tracking, including the full resolution refinement
+    MotionEstimation,
+    OverlayRendering,
+    JpegEncode,       // Of the viewer's frames
+
+    Count
+  };
+
+  const char* stageName(Stage stage);
+
+  void record(Stage stage, std::chrono::steady_clock::duration latency);
+
+  // Records the time until it goes out of scope
+  class ScopedLatency
+  {
+  public:
+    explicit ScopedLatency(Stage stage)
+      : stage_(stage)
+      , start_(std::chrono::steady_clock::now())
+    {}
+
+    ~ScopedLatency() { record(stage_, std::chrono::steady_clock::now() - start_); }
+
+    ScopedLatency(const ScopedLatency&) = delete;
+    ScopedLatency& operator=(const ScopedLatency&) = delete;
+
+  private:
+    const Stage stage_;
+    const std::chrono::steady_clock::time_point start_;
+  };
+
+  // Merged over all the threads which ever recorded, since the start of the process
+  struct Summary
+  {
+    uint64_t count;
+    double sum; // [s]
+    double p50; // [s]
+    double p99; // [s]
+    double max; // [s]
+  };
+
+  Summary summary(Stage stage);
+
+  // All the stages in the Prometheus text exposition format
+  std::string prometheusText();
+}
+
+#endif
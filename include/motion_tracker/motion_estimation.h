@@ -2,13 +2,79 @@
 #define MotionEstimator_h
 
 #include <motion_tracker/optic_flow.h>
+#include <motion_tracker/ground_projection.h>
 #include <motion_tracker/camera/camera_config.h>
+#include <cpp-toolkit/moving_average.h>
+#include <chrono>
+#include <optional>
 #include <vector>
-#include <tuple>
 
-std::pair<double, std::vector<bool>> getTurnRateAndValidIndicatorFromFlow(const CameraConfig& params, const std::vector<OpticFlow>& flow);
-double getTurnRateFromFlow(const CameraConfig& params, const std::vector<OpticFlow>& flow);
+// The estimates only use the valid vectors of <flow>, and mark the ones which turn out to be
+//  unusable (e.g. they can not be projected) as invalid.
+double getTurnRateFromFlow(const CameraConfig& params, FlowBatch& flow);
+double getSpeedFromFlow(const CameraConfig& params, FlowBatch& flow, double turn_rate);
+
+struct OdometryEstimate
+{
+  double turn_rate = 0; // [rad/s]
+  double speed = 0;     // [m/s]
+
+  // Number of flow vectors each estimate is based on
+  size_t rotation_vectors = 0;
+  size_t translation_vectors = 0;
+
+  // Time since the frame each estimate was measured on [s], non-zero while it is held and infinite
+  //  until it was measured at all
+  double turn_rate_age = 0;
+  double speed_age = 0;
+};
+
+// Estimates the turn rate and the speed of a camera in one call, with the same methods as the
+//  functions above. The scratch buffers and the ground projection are owned by the estimator, so
+//  once the buffers have grown to the flow sizes seen, the estimates do not allocate.
+class OdometryEstimator
+{
+public:
+  // If <config> matches one of the compile time camera models (see camera_model.h), the estimation
+  //  specialized for it is used, unless <use_camera_models> is false.
+  explicit OdometryEstimator(const CameraConfig& config, bool use_camera_models = true);
+
+  // The turn rate is estimated from <rotation_flow>, and then removed from <translation_flow> for
+  //  the speed. The turn rate removed is averaged over the last 3 estimates, as a single one is too
+  //  noisy to compensate with. The vectors which could not be used are marked invalid in the
+  //  batches' masks.
+  OdometryEstimate estimate(FlowBatch& rotation_flow, FlowBatch& translation_flow);
+
+  using TimeStamp = std::chrono::steady_clock::time_point;
+
+  // Same as above, for flows tracked at their own rates: a nullptr flow was not tracked on the frame
+  //  taken at <stamp>, so its estimate is held from the last frame it was, and tagged with its age.
+  OdometryEstimate estimate(FlowBatch* rotation_flow, FlowBatch* translation_flow, TimeStamp stamp);
+
+  const CameraConfig& config() const { return config_; }
+  bool usesCameraModel() const { return model_ != nullptr; }
+
+  // The estimation specialized for a camera model
+  struct ModelEntry;
+
+private:
+  const CameraConfig config_;
+  const GroundProjection projection_;
+
+  const ModelEntry* const model_;
+
+  std::vector<float> angular_flow_;
+  std::vector<double> linear_flow_;
+
+  MovingAverage<double, 3> turn_rate_filter_;
+  double compensation_turn_rate_ = 0;
+
+  // The last estimates, and the frames they were measured on
+  OdometryEstimate held_;
+  std::optional<TimeStamp> turn_rate_stamp_;
+  std::optional<TimeStamp> speed_stamp_;
+
+  OdometryEstimate estimateFrom(FlowBatch* rotation_flow, FlowBatch* translation_flow, double held_turn_rate);
+};
 
-std::pair<double, std::vector<bool>> getSpeedAndValidIndicatorFromFlow(const CameraConfig& params, const std::vector<OpticFlow>& flow, double turn_rate);
-double getSpeedFromFlow(const CameraConfig& params, const std::vector<OpticFlow>& flow, double turn_rate);
 #endif
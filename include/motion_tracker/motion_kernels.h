@@ -0,0 +1,19 @@
+#ifndef MotionKernels_h
+#define MotionKernels_h
+
+#include <cstddef>
+
+// Batch kernels of the motion estimation, working on the arrays of a FlowBatch.
+
+// asin with a minimax polynomial (after Cephes' asinf), accurate to a few float ulps over [-1, 1].
+//  NaN outside of it.
+float fastAsin(float x);
+
+// Angular flow of the cylindrical projection: asin((2*end_x - width)/f) - asin((2*start_x - width)/f)
+//  for each of the <count> flow vectors, NaN where the projection is not defined.
+void cylindricalAngularFlow(const float* start_x, const float* end_x, size_t count, float width, float focal_length, float* angular_flow);
+
+// Name of the instruction set the kernels were compiled for.
+const char* motionKernelInstructionSet();
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef OdometryHost_h
+#define OdometryHost_h
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <functional>
+
+#include <motion_tracker/camera/frame_source.h>
+#include <motion_tracker/camera/frame_recorder.h>
+#include <motion_tracker/region_manager.h>
+#include <motion_tracker/motion_estimation.h>
+#include <motion_tracker/pipeline.h>
+#include <cpp-toolkit/thread_pool.h>
+
+// Everything the stages of a camera pass on about a frame
+struct FramePacket
+{
+  size_t camera = 0;
+  Frame frame;
+  std::shared_ptr<const FramePyramid> pyramid;
+  RegionManager::Flows flows;
+
+  double load = 0;
+  size_t degradation = 0;
+
+  double yaw_speed = 0;
+  double linear_speed = 0;
+  double yaw_speed_age = 0;    // [s] Infinite until the first measurement
+  double linear_speed_age = 0; // [s] Same as above
+  size_t rotation_vectors = 0;
+  size_t translation_vectors = 0;
+  double total_turn = 0;
+  double total_dist = 0;
+
+  double fps = 0;
+  std::chrono::steady_clock::time_point produced; // When a live frame was captured, else when the source stage passed it on
+  double latency = 0; // [ms] From then until the frame reached the publish stage
+};
+
+using FramePipeline = Pipeline<FramePacket>;
+
+// How the frames of a camera are processed
+struct ChannelSettings
+{
+  LkEngine lk_engine = LkEngine::OpenCV;
+  FeatureDetector::Type detector = FeatureDetector::Type::ShiTomasi;
+  double tracking_scale = 1.0;
+  bool refine = false;
+  double target_fps = 30;
+  double yaw_rate = 0;   // [Hz], 0: every frame
+  double speed_rate = 0; // [Hz], 0: every frame
+
+  // The regions tracked. Empty: the upper half of the frame for the turn rate at <yaw_rate>, and the
+  //  lower half for the speed at <speed_rate>.
+  std::vector<TrackedRegion> regions;
+  bool drop_frames = false; // Drop the frames the stages can not keep up with (live cameras) instead of waiting for them
+  double trace_slow_frame = 0; // [ms] With tracing enabled, a frame taking longer end to end dumps the trace, 0: never
+};
+
+// End-to-end latencies of the frames of a camera [ms]
+struct LatencyStats
+{
+  size_t frames = 0;
+  double last = 0;
+  double mean = 0;
+  double max = 0;
+};
+
+// The odometry of a single camera: its own regions, budget and estimator, run as a pipeline of
+//  capture, preprocess, track, estimate and publish stages, with the tracking work on a pool shared
+//  with the other cameras.
+class OdometryChannel
+{
+public:
+  // Called from the publish stage of the channel, with the results of every frame
+  using Publisher = std::function<void(FramePacket&)>;
+
+  OdometryChannel(size_t index, std::unique_ptr<FrameSource> source, const ChannelSettings& settings, ThreadPool& workers,
+    std::unique_ptr<FrameRecorder> recorder = nullptr);
+  ~OdometryChannel();
+
+  // Sets the trackers up on the first frame of the source and starts the stages. Returns false if
+  //  the source has no frames.
+  bool start(Publisher publish);
+  void stop();
+  void wait();
+
+  size_t index() const { return index_; }
+  FrameSource& source() { return *source_; }
+  size_t maxDegradationLevel() const;
+
+  LatencyStats latency() const;
+  std::vector<FramePipeline::StageStats> stageStats() const;
+
+private:
+  const size_t index_;
+  const ChannelSettings settings_;
+  std::unique_ptr<FrameSource> source_;
+  std::unique_ptr<FrameRecorder> recorder_;
+  ThreadPool& workers_;
+
+  struct Internals;
+  std::unique_ptr<Internals> internals_;
+};
+
+// The odometry of all the cameras of a host, combined
+struct AggregatedOdometry
+{
+  double turn_rate = 0;  // [rad/s] Mean of the cameras' latest estimates, weighted by their vector counts
+  double speed = 0;      // [m/s]   Same as above
+  double total_turn = 0; // [rad]   Mean of the cameras' integrated values
+  double total_dist = 0; // [m]     Same as above
+  size_t cameras = 0;    // Number of cameras which produced an estimate yet
+};
+
+// Runs the odometry of any number of cameras in one process. The cameras' stages run on their own
+//  threads, but all the tracking work is queued to one shared pool, in the order the cameras
+//  post it, so the cores are shared between the cameras instead of being oversubscribed by a pool
+//  per camera.
+class OdometryHost
+{
+public:
+  // <num_workers> threads are shared by all cameras, 0: one per core.
+  explicit OdometryHost(size_t num_workers = 0);
+  ~OdometryHost();
+
+  size_t addCamera(std::unique_ptr<FrameSource> source, const ChannelSettings& settings, std::unique_ptr<FrameRecorder> recorder = nullptr);
+
+  // Runs every camera until its source ends or stop() is called. <publish> is called from the
+  //  cameras' own publish stages, so concurrently for different cameras. Returns false if a camera
+  //  had no frames at all; the others are run anyway.
+  bool run(const OdometryChannel::Publisher& publish);
+  void stop();
+
+  AggregatedOdometry odometry() const;
+
+  size_t numCameras() const { return channels_.size(); }
+  const OdometryChannel& camera(size_t index) const { return *channels_[index]; }
+  ThreadPool& workers() { return workers_; }
+
+private:
+  void aggregate(const FramePacket& packet);
+
+  ThreadPool workers_;
+  std::vector<std::unique_ptr<OdometryChannel>> channels_;
+
+  // The last estimates of a camera
+  struct CameraOdometry
+  {
+    double turn_rate;
+    double speed;
+    size_t rotation_vectors;
+    size_t translation_vectors;
+    double total_turn;
+    double total_dist;
+  };
+
+  mutable std::mutex lock_;
+  std::vector<std::optional<CameraOdometry>> latest_;
+  AggregatedOdometry odometry_;
+};
+
+#endif
@@ -1,16 +1,104 @@
 #ifndef OpticFlow_h
 #define OpticFlow_h
 
-#include <cpp-toolkit/primitives_2d.h>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
 
-struct OpticFlow
+// The flow vectors found between two frames, stored as separate contiguous arrays of the start and
+//  end coordinates (subpixel, in full frame coordinates) so that the loops over them
+//  can be vectorized. All the vectors of a batch share the time between the two frames.
+//
+// Each vector has a validity bit (bit i % 64 of valid[i / 64]); vectors are added as valid, and
+//  the consumers clear the bits of the ones they can not use.
+struct FlowBatch
 {
-  OpticFlow(Point2i start, Point2i end, double dt): start(start), end(end), dt(dt) {}
+  using ValidityMask = std::vector<uint64_t>;
 
-  Point2i start;
-  Point2i end;
+  std::vector<float> start_x;
+  std::vector<float> start_y;
+  std::vector<float> end_x;
+  std::vector<float> end_y;
 
-  double dt;
+  ValidityMask valid;
+
+  double dt = 0; // [s]
+
+  size_t size() const { return start_x.size(); }
+  bool empty() const { return start_x.empty(); }
+
+  // Keeps the capacity, so a batch reused across frames stops allocating once it has grown large enough.
+  void clear()
+  {
+    start_x.clear();
+    start_y.clear();
+    end_x.clear();
+    end_y.clear();
+    valid.clear();
+    dt = 0;
+  }
+
+  void reserve(size_t count)
+  {
+    start_x.reserve(count);
+    start_y.reserve(count);
+    end_x.reserve(count);
+    end_y.reserve(count);
+    valid.reserve(maskWords(count));
+  }
+
+  void add(float from_x, float from_y, float to_x, float to_y)
+  {
+    size_t index = size();
+    start_x.push_back(from_x);
+    start_y.push_back(from_y);
+    end_x.push_back(to_x);
+    end_y.push_back(to_y);
+
+    if (index % 64 == 0)
+    {
+      valid.push_back(0);
+    }
+    valid.back() |= uint64_t(1) << (index % 64);
+  }
+
+  // Adds the valid vectors of <other>. Their displacements are rescaled to this batch's time step,
+  //  so batches tracked over different frame intervals can be estimated from together; an empty
+  //  batch takes the time step of <other>.
+  void append(const FlowBatch& other)
+  {
+    if (empty())
+    {
+      dt = other.dt;
+    }
+    float scale = other.dt > 0 ? static_cast<float>(dt / other.dt) : 1.0f;
+
+    reserve(size() + other.size());
+    for (size_t i = 0; i < other.size(); ++i)
+    {
+      if (other.isValid(i))
+      {
+        add(other.start_x[i], other.start_y[i],
+          other.start_x[i] + (other.end_x[i] - other.start_x[i]) * scale,
+          other.start_y[i] + (other.end_y[i] - other.start_y[i]) * scale);
+      }
+    }
+  }
+
+  bool isValid(size_t index) const { return (valid[index / 64] >> (index % 64)) & 1; }
+  void invalidate(size_t index) { valid[index / 64] &= ~(uint64_t(1) << (index % 64)); }
+
+  size_t numValid() const
+  {
+    size_t count = 0;
+    for (auto word : valid)
+    {
+      count += __builtin_popcountll(word);
+    }
+    return count;
+  }
+
+  static size_t maskWords(size_t count) { return (count + 63) / 64; }
 };
 
 #endif
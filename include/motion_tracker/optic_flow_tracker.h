@@ -2,27 +2,64 @@
 #define OpticFlowTracker_h
 
 #include <motion_tracker/camera/camera_frame.h>
+#include <motion_tracker/frame_pyramid.h>
+#include <motion_tracker/lk_engine.h>
+#include <motion_tracker/tracking_budget.h>
+#include <motion_tracker/feature_detector.h>
 #include <motion_tracker/optic_flow.h>
 #include <future>
 
 class OpticFlowTracker
 {
 public:
-  OpticFlowTracker(const Frame& start_frame, Rect<unsigned int> roi, size_t num_points);
+  // The pyramids handed to the tracker have to be built with at least this window size and depth.
+  //  Budgets may reduce the window used for tracking, but not increase it beyond this.
+  static constexpr int window_size = 30;
+  static constexpr int pyramid_levels = 1;
+
+  // The points are replenished per tile of this size [px], and kept at least this far apart [px].
+  static constexpr int detection_tile_size = 80;
+  static constexpr float min_corner_distance = 20;
+
+  // <roi> is given in full resolution coordinates. The initial points are found with <detector>.
+  OpticFlowTracker(std::shared_ptr<const FramePyramid> start_pyramid, Rect<unsigned int> roi, size_t num_points,
+    FeatureDetector::Type detector = FeatureDetector::Type::ShiTomasi);
   ~OpticFlowTracker();
 
-  [[nodiscard]] std::vector<OpticFlow> calculate(const Frame& frame);
-  [[nodiscard]] std::packaged_task<std::vector<OpticFlow>()> packageCalculation(const Frame& frame)
+  // Tracks the points from the previously processed pyramid into <pyramid>. The resulting flow is
+  //  expressed in full frame coordinates, at full resolution even if the pyramids are built from
+  //  downscaled frames.
+  [[nodiscard]] FlowBatch calculate(const std::shared_ptr<const FramePyramid>& pyramid);
+  void calculate(const std::shared_ptr<const FramePyramid>& pyramid, FlowBatch& flow);
+
+  // Selects the Lucas-Kanade implementation used for tracking, OpenCV by default.
+  void setEngine(LkEngine engine);
+
+  // Lets the tracker split its points into chunks tracked in parallel on <workers> (nullptr: track
+  //  serially on the calling thread). The pool has to outlive the tracker.
+  void setWorkers(ThreadPool* workers);
+
+  // Selects the detector used to replenish the tracked points from now on.
+  void setDetector(FeatureDetector::Type type);
+
+  // Takes effect from the next frame; surplus points are dropped right away.
+  void setBudget(const TrackingBudget& budget);
+  const TrackingBudget& budget() const;
+
+  // The points carried over to the next frame, which are topped up to the budget by its detection.
+  size_t numPoints() const;
+
+  // The results are written into <flow>, which allows the caller to reuse its storage across frames.
+  [[nodiscard]] std::packaged_task<void()> packageCalculation(const std::shared_ptr<const FramePyramid>& pyramid, FlowBatch& flow)
   {
-    return std::packaged_task<std::vector<OpticFlow>()>([&]()
+    return std::packaged_task<void()>([&]()
     {
-      return calculate(frame);
+      calculate(pyramid, flow);
     });
   }
 
 private:
   const Rect<unsigned int> roi;
-  const size_t num_tracked_points;
 
   struct Internal;
   std::unique_ptr<Internal> internal_;
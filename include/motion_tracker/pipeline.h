@@ -0,0 +1,276 @@
+#ifndef Pipeline_h
+#define Pipeline_h
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <motion_tracker/spsc_queue.h>
+#include <motion_tracker/tracing.h>
+
+// Runs the processing of a stream of packets as a chain of stages, each on its own thread, so that
+//  consecutive packets are processed by different stages at the same time.
+//
+// The source stage produces the packets, and every further stage receives them from the previous one
+//  through a bounded SpscQueue. Once the last stage is done with a packet, it is handed back to the
+//  source for reuse, so the buffers inside a packet keep their capacity across frames.
+template<class Packet>
+class Pipeline
+{
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // What the stage in front of a full queue does with its packet.
+  enum class OverflowPolicy
+  {
+    Block,     // Waits for room, so every packet is processed (replays)
+    DropNewest // Drops the packet, so the latency stays bounded (live cameras)
+  };
+
+  // Returns false to drop the packet. The source returns false once the stream has ended.
+  using Stage = std::function<bool(Packet&)>;
+
+  // Called by the thread of the last stage for every packet that made it through, with the time since
+  //  the packet's start time.
+  using LatencyCallback = std::function<void(const Packet&, Clock::duration)>;
+
+  // Returns the time a packet's latency is measured from, e.g. when its data was captured. Without
+  //  one, it is the time the source stage returned the packet.
+  using StartTime = std::function<Clock::time_point(const Packet&)>;
+
+  struct StageStats
+  {
+    std::string name;
+    size_t processed;
+    size_t dropped; // Including the packets dropped in front of the stage's queue
+  };
+
+  explicit Pipeline(Stage source)
+  {
+    stages_.push_back(std::make_unique<StageRunner>("source", std::move(source), 0, OverflowPolicy::Block));
+  }
+
+  ~Pipeline()
+  {
+    stop();
+    wait();
+  }
+
+  Pipeline(const Pipeline&) = delete;
+  Pipeline& operator=(const Pipeline&) = delete;
+
+  // Adds a stage after the last one, receiving the packets through a queue of <queue_depth>.
+  //  <policy> applies when that queue is full. Only valid before start().
+  void addStage(std::string name, Stage stage, size_t queue_depth, OverflowPolicy policy)
+  {
+    stages_.push_back(std::make_unique<StageRunner>(std::move(name), std::move(stage), queue_depth, policy));
+  }
+
+  void setLatencyCallback(LatencyCallback callback) { latency_callback_ = std::move(callback); }
+  void setStartTime(StartTime start_time) { start_time_ = std::move(start_time); }
+
+  void start()
+  {
+    // Enough room for every packet that can be in flight, so the last stage never has to drop one
+    size_t in_flight = stages_.size();
+    for (const auto& stage : stages_)
+    {
+      in_flight += stage->input ? stage->input->capacity() : 0;
+    }
+    recycled_ = std::make_unique<SpscQueue<Slot>>(in_flight);
+
+    for (size_t i = 0; i < stages_.size(); ++i)
+    {
+      stages_[i]->thread = std::thread([this, i](){ i == 0 ? runSource() : runStage(i); });
+    }
+  }
+
+  // Makes the stages finish without waiting for the queued packets to be processed.
+  void stop() { stopping_ = true; }
+
+  // Returns once every stage finished, either because the source ended and the queued packets were
+  //  processed, or because of stop().
+  void wait()
+  {
+    for (auto& stage : stages_)
+    {
+      if (stage->thread.joinable())
+      {
+        stage->thread.join();
+      }
+    }
+  }
+
+  std::vector<StageStats> stats() const
+  {
+    std::vector<StageStats> result;
+    for (const auto& stage : stages_)
+    {
+      result.push_back({stage->name, stage->processed.load(), stage->dropped.load()});
+    }
+    return result;
+  }
+
+private:
+  struct Slot
+  {
+    Packet packet;
+    Clock::time_point start;
+  };
+
+  struct StageRunner
+  {
+    StageRunner(std::string name_, Stage stage_, size_t queue_depth, OverflowPolicy policy_)
+      : name(std::move(name_))
+      , trace_name(tracing::intern(name))
+      , stage(std::move(stage_))
+      , input(queue_depth > 0 ? std::make_unique<SpscQueue<Slot>>(queue_depth) : nullptr)
+      , policy(policy_)
+    {}
+
+    std::string name;
+    const char* trace_name;
+    Stage stage;
+    std::unique_ptr<SpscQueue<Slot>> input;
+    OverflowPolicy policy;
+
+    std::atomic<bool> finished{false}; // No more packets will be pushed to the next stage's queue
+    std::atomic<size_t> processed{0};
+    std::atomic<size_t> dropped{0};
+    std::thread thread;
+  };
+
+  // Yields for a few rounds before falling back to short sleeps, as the stages mostly wait on each
+  //  other for a fraction of a frame.
+  class Backoff
+  {
+  public:
+    void pause()
+    {
+      if (++rounds_ < 64)
+      {
+        std::this_thread::yield();
+      }
+      else
+      {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+      }
+    }
+
+    void reset() { rounds_ = 0; }
+
+  private:
+    unsigned rounds_ = 0;
+  };
+
+  void runSource()
+  {
+    auto& source = *stages_.front();
+    tracing::setThreadName(source.name);
+    while (!stopping_)
+    {
+      Slot slot;
+      recycled_->tryPop(slot);
+      if (!runTraced(source, slot.packet))
+      {
+        break;
+      }
+
+      slot.start = start_time_ ? start_time_(slot.packet) : Clock::now();
+      source.processed++;
+      forward(1, slot);
+    }
+    source.finished = true;
+  }
+
+  void runStage(size_t index)
+  {
+    auto& runner = *stages_[index];
+    const auto& upstream = *stages_[index - 1];
+    bool last = index + 1 == stages_.size();
+    tracing::setThreadName(runner.name);
+
+    Slot slot;
+    Backoff backoff;
+    while (!stopping_)
+    {
+      if (!runner.input->tryPop(slot))
+      {
+        // Checked before the second attempt, as a packet may have been pushed just before finishing
+        bool upstream_finished = upstream.finished;
+        if (!runner.input->tryPop(slot))
+        {
+          if (upstream_finished)
+          {
+            break;
+          }
+          backoff.pause();
+          continue;
+        }
+      }
+      backoff.reset();
+
+      if (!runTraced(runner, slot.packet))
+      {
+        runner.dropped++;
+        continue;
+      }
+      runner.processed++;
+
+      if (!last)
+      {
+        forward(index + 1, slot);
+        continue;
+      }
+
+      if (latency_callback_)
+      {
+        latency_callback_(slot.packet, Clock::now() - slot.start);
+      }
+      // Only full if stop() left packets behind, in which case they are not needed anymore
+      recycled_->tryPush(slot);
+    }
+    runner.finished = true;
+  }
+
+  // Every run of a stage is a span of the trace, named after the stage
+  static bool runTraced(StageRunner& runner, Packet& packet)
+  {
+    tracing::Span span(runner.trace_name);
+    return runner.stage(packet);
+  }
+
+  // Pushes <slot> to the queue of stage <index>, if there is one.
+  void forward(size_t index, Slot& slot)
+  {
+    if (index >= stages_.size())
+    {
+      recycled_->tryPush(slot);
+      return;
+    }
+
+    auto& next = *stages_[index];
+    Backoff backoff;
+    while (!next.input->tryPush(slot))
+    {
+      if (next.policy == OverflowPolicy::DropNewest || stopping_)
+      {
+        next.dropped++;
+        return;
+      }
+      backoff.pause();
+    }
+  }
+
+  std::vector<std::unique_ptr<StageRunner>> stages_;
+  std::unique_ptr<SpscQueue<Slot>> recycled_;
+  LatencyCallback latency_callback_;
+  StartTime start_time_;
+  std::atomic<bool> stopping_{false};
+};
+
+#endif
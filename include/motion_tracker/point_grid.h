@@ -0,0 +1,54 @@
+#ifndef PointGrid_h
+#define PointGrid_h
+
+#include <array>
+#include <vector>
+#include <cstdint>
+#include <opencv2/core/types.hpp>
+
+// Spatial index of the tracked points, used to keep them at least <min_distance> apart. The area is
+//  divided into cells of <min_distance> size, so any point closer than that to a query point lies in
+//  one of the 3x3 cells around it, which makes both the insertion and the rejection of a point O(1).
+class PointGrid
+{
+public:
+  PointGrid(const cv::Rect2f& area, float min_distance);
+
+  void clear();
+
+  // Returns false if the point is outside of the area, or its cell is full.
+  bool insert(const cv::Point2f& pt);
+  void erase(const cv::Point2f& pt);
+
+  // Inserts the point only if there is no other point within <min_distance> of it.
+  bool tryInsert(const cv::Point2f& pt);
+  bool hasNeighbour(const cv::Point2f& pt) const;
+
+  size_t size() const { return size_; }
+
+private:
+  // Points which are at least <min_distance> apart fit four to a cell; closer ones can only appear
+  //  while tracking, in which case the points which do not fit are dropped.
+  static constexpr size_t cell_capacity = 4;
+
+  struct Cell
+  {
+    std::array<cv::Point2f, cell_capacity> points;
+    uint8_t count = 0;
+  };
+
+  int column(float x) const { return static_cast<int>((x - area_.x) * inv_cell_size_); }
+  int row(float y) const { return static_cast<int>((y - area_.y) * inv_cell_size_); }
+  bool contains(const cv::Point2f& pt) const;
+
+  const cv::Rect2f area_;
+  const float min_distance_sq_;
+  const float inv_cell_size_;
+  const int columns_;
+  const int rows_;
+
+  std::vector<Cell> cells_;
+  size_t size_;
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef RegionManager_h
+#define RegionManager_h
+
+#include <motion_tracker/optic_flow_tracker.h>
+#include <cpp-toolkit/thread_pool.h>
+#include <string>
+#include <vector>
+
+// A band of the frame tracked by its own OpticFlowTracker.
+struct TrackedRegion
+{
+  // Which estimate the region's flow is used for
+  enum class Role
+  {
+    Yaw,   // Turn rate
+    Speed, // Speed over the ground
+    Both
+  };
+
+  std::string name;
+  Rect<unsigned int> roi; // Full resolution coordinates
+  Role role;
+  size_t num_points;          // At the full budget
+  unsigned int decimation = 1; // The region is tracked on every n-th frame
+  double rate = 0;             // [Hz] The region is tracked at most this often, 0: on every frame it is due by the decimation
+};
+
+// Tracks any number of regions of the same frames, in parallel on a shared pool, and merges their
+//  flows by role for the estimation.
+class RegionManager
+{
+public:
+  // The per frame results, with every batch in full frame coordinates
+  struct Flows
+  {
+    std::vector<FlowBatch> regions; // Indexed like the regions; only updated on the frames they are tracked on
+    FlowBatch rotation;             // The regions tracked on this frame with the Yaw or Both role
+    FlowBatch translation;          // The regions tracked on this frame with the Speed or Both role
+
+    // Whether any region of the role was tracked on this frame; if not, the last estimate from it
+    //  still holds (see OdometryEstimator).
+    bool rotation_tracked = false;
+    bool translation_tracked = false;
+  };
+
+  // The workers run the regions and share their point tracking, so they have to outlive the manager.
+  //  The regions' initial points are found with <detector>.
+  RegionManager(const std::shared_ptr<const FramePyramid>& start_pyramid, std::vector<TrackedRegion> regions, ThreadPool& workers,
+    FeatureDetector::Type detector = FeatureDetector::Type::ShiTomasi);
+  ~RegionManager();
+
+  void setEngine(LkEngine engine);
+  void setDetector(FeatureDetector::Type type);
+
+  // <budget> covers all regions: its points are shared out in proportion to the regions' own point
+  //  counts (see totalPoints()), the rest of it applies to every region.
+  void setBudget(const TrackingBudget& budget);
+
+  // Tracks the regions due on this frame into <flows>, which allows the caller to reuse its storage
+  //  across frames.
+  void track(const std::shared_ptr<const FramePyramid>& pyramid, Flows& flows);
+
+  const std::vector<TrackedRegion>& regions() const { return regions_; }
+  size_t totalPoints() const;
+
+private:
+  const std::vector<TrackedRegion> regions_;
+  ThreadPool& workers_;
+
+  std::vector<std::unique_ptr<OpticFlowTracker>> trackers_;
+  size_t frame_count_ = 1; // The start pyramid is the first frame of every region
+  Frame::TimeStamp last_stamp_;
+  std::vector<Frame::TimeStamp> next_due_; // For the regions with a rate
+
+  bool isDue(size_t index, const Frame::TimeStamp& stamp);
+
+  std::vector<size_t> due_;                       // Scratch: the regions tracked on the current frame
+  std::vector<std::packaged_task<void()>> tasks_; // Scratch
+  std::vector<std::future<void>> done_;           // Scratch
+};
+
+#endif
@@ -0,0 +1,298 @@
+#ifndef Simd_h
+#define Simd_h
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Thin abstraction over the integer SIMD operations used by the fixed-point image kernels. Every
+//  instruction set provides the same set of operations with the same semantics; in particular the
+//  zip/pack_zipped pairs work within 128 bit lanes (as the x86 unpack/pack instructions do), so
+//  zip_lo/zip_hi followed by pack_zipped keeps the elements in order on all of them.
+//
+//  i16: int16 lanes, i32: int32 lanes (half as many), f32: float lanes (as many as i32).
+//
+// The *_f32 operations work on whole float vectors; comparisons return lane masks (all bits set
+//  where true), which select_f32 takes to pick between two vectors.
+//
+// NativeOps is the widest implementation available for the target the code is compiled for.
+namespace simd
+{
+
+// Plain C++ implementation, with the semantics of the 128 bit instruction sets.
+struct ScalarOps
+{
+  static constexpr const char* name = "scalar";
+  static constexpr int lanes = 8;
+
+  using i16 = std::array<int16_t, 8>;
+  using i32 = std::array<int32_t, 4>;
+  using f32 = std::array<float, 4>;
+
+  static i16 load_u8(const uint8_t* p) { i16 r; for (int i = 0; i < 8; ++i) { r[i] = p[i]; } return r; }
+  static i16 load(const int16_t* p) { i16 r; for (int i = 0; i < 8; ++i) { r[i] = p[i]; } return r; }
+  static void store(int16_t* p, const i16& v) { for (int i = 0; i < 8; ++i) { p[i] = v[i]; } }
+
+  static i16 set_pair(int16_t a, int16_t b) { return {a, b, a, b, a, b, a, b}; }
+
+  static i16 zip_lo(const i16& a, const i16& b) { return {a[0], b[0], a[1], b[1], a[2], b[2], a[3], b[3]}; }
+  static i16 zip_hi(const i16& a, const i16& b) { return {a[4], b[4], a[5], b[5], a[6], b[6], a[7], b[7]}; }
+
+  static i32 madd(const i16& a, const i16& b)
+  {
+    i32 r;
+    for (int i = 0; i < 4; ++i) { r[i] = int32_t(a[2*i]) * b[2*i] + int32_t(a[2*i + 1]) * b[2*i + 1]; }
+    return r;
+  }
+  static i32 add(const i32& a, const i32& b) { i32 r; for (int i = 0; i < 4; ++i) { r[i] = a[i] + b[i]; } return r; }
+
+  template<int Shift>
+  static i32 descale(const i32& v) { i32 r; for (int i = 0; i < 4; ++i) { r[i] = (v[i] + (1 << (Shift - 1))) >> Shift; } return r; }
+
+  static int16_t saturate(int32_t v) { return static_cast<int16_t>(v < INT16_MIN ? INT16_MIN : (v > INT16_MAX ? INT16_MAX : v)); }
+  static i16 pack(const i32& a, const i32& b)
+  {
+    return {saturate(a[0]), saturate(a[1]), saturate(a[2]), saturate(a[3]), saturate(b[0]), saturate(b[1]), saturate(b[2]), saturate(b[3])};
+  }
+  static i16 pack_zipped(const i32& lo, const i32& hi) { return pack(lo, hi); }
+
+  static i32 as_i32(const i16& v) { i32 r; for (int i = 0; i < 4; ++i) { r[i] = int32_t(uint16_t(v[2*i])) | (int32_t(v[2*i + 1]) * 65536); } return r; }
+  static i32 low16(const i32& v) { i32 r; for (int i = 0; i < 4; ++i) { r[i] = static_cast<int16_t>(v[i] & 0xffff); } return r; }
+  static i32 high16(const i32& v) { i32 r; for (int i = 0; i < 4; ++i) { r[i] = v[i] >> 16; } return r; }
+
+  static i16 subs(const i16& a, const i16& b) { i16 r; for (int i = 0; i < 8; ++i) { r[i] = saturate(int32_t(a[i]) - b[i]); } return r; }
+
+  static f32 zero() { return {0, 0, 0, 0}; }
+  static f32 accumulate(const f32& acc, const i32& v) { f32 r; for (int i = 0; i < 4; ++i) { r[i] = acc[i] + v[i]; } return r; }
+  static float sum(const f32& v) { return v[0] + v[1] + v[2] + v[3]; }
+
+  static constexpr int f32_lanes = 4;
+
+  static f32 load_f32(const float* p) { return {p[0], p[1], p[2], p[3]}; }
+  static void store_f32(float* p, const f32& v) { for (int i = 0; i < 4; ++i) { p[i] = v[i]; } }
+  static f32 set_f32(float v) { return {v, v, v, v}; }
+
+  static f32 add_f32(const f32& a, const f32& b) { f32 r; for (int i = 0; i < 4; ++i) { r[i] = a[i] + b[i]; } return r; }
+  static f32 sub_f32(const f32& a, const f32& b) { f32 r; for (int i = 0; i < 4; ++i) { r[i] = a[i] - b[i]; } return r; }
+  static f32 mul_f32(const f32& a, const f32& b) { f32 r; for (int i = 0; i < 4; ++i) { r[i] = a[i] * b[i]; } return r; }
+  static f32 sqrt_f32(const f32& a) { f32 r; for (int i = 0; i < 4; ++i) { r[i] = std::sqrt(a[i]); } return r; }
+  static f32 abs_f32(const f32& a) { f32 r; for (int i = 0; i < 4; ++i) { r[i] = std::fabs(a[i]); } return r; }
+
+  static f32 gt_f32(const f32& a, const f32& b) { f32 r; for (int i = 0; i < 4; ++i) { r[i] = bits(a[i] > b[i] ? 0xffffffffu : 0u); } return r; }
+  static f32 select_f32(const f32& mask, const f32& a, const f32& b)
+  {
+    f32 r;
+    for (int i = 0; i < 4; ++i) { r[i] = bits((bits(mask[i]) & bits(a[i])) | (~bits(mask[i]) & bits(b[i]))); }
+    return r;
+  }
+  static f32 sign_f32(const f32& a) { f32 r; for (int i = 0; i < 4; ++i) { r[i] = bits(bits(a[i]) & 0x80000000u); } return r; }
+  static f32 or_f32(const f32& a, const f32& b) { f32 r; for (int i = 0; i < 4; ++i) { r[i] = bits(bits(a[i]) | bits(b[i])); } return r; }
+
+  static uint32_t bits(float v) { uint32_t r; std::memcpy(&r, &v, sizeof(r)); return r; }
+  static float bits(uint32_t v) { float r; std::memcpy(&r, &v, sizeof(r)); return r; }
+};
+
+#if defined(__SSE4_1__)
+struct Sse41Ops
+{
+  static constexpr const char* name = "sse4.1";
+  static constexpr int lanes = 8;
+
+  using i16 = __m128i;
+  using i32 = __m128i;
+  using f32 = __m128;
+
+  static i16 load_u8(const uint8_t* p) { return _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p))); }
+  static i16 load(const int16_t* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+  static void store(int16_t* p, i16 v) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v); }
+
+  static i16 set_pair(int16_t a, int16_t b) { return _mm_set1_epi32(static_cast<int32_t>((uint32_t(uint16_t(b)) << 16) | uint16_t(a))); }
+
+  static i16 zip_lo(i16 a, i16 b) { return _mm_unpacklo_epi16(a, b); }
+  static i16 zip_hi(i16 a, i16 b) { return _mm_unpackhi_epi16(a, b); }
+
+  static i32 madd(i16 a, i16 b) { return _mm_madd_epi16(a, b); }
+  static i32 add(i32 a, i32 b) { return _mm_add_epi32(a, b); }
+
+  template<int Shift>
+  static i32 descale(i32 v) { return _mm_srai_epi32(_mm_add_epi32(v, _mm_set1_epi32(1 << (Shift - 1))), Shift); }
+
+  static i16 pack(i32 a, i32 b) { return _mm_packs_epi32(a, b); }
+  static i16 pack_zipped(i32 lo, i32 hi) { return _mm_packs_epi32(lo, hi); }
+
+  static i32 as_i32(i16 v) { return v; }
+  static i32 low16(i32 v) { return _mm_srai_epi32(_mm_slli_epi32(v, 16), 16); }
+  static i32 high16(i32 v) { return _mm_srai_epi32(v, 16); }
+
+  static i16 subs(i16 a, i16 b) { return _mm_subs_epi16(a, b); }
+
+  static f32 zero() { return _mm_setzero_ps(); }
+  static f32 accumulate(f32 acc, i32 v) { return _mm_add_ps(acc, _mm_cvtepi32_ps(v)); }
+  static float sum(f32 v)
+  {
+    alignas(16) float values[4];
+    _mm_store_ps(values, v);
+    return values[0] + values[1] + values[2] + values[3];
+  }
+
+  static constexpr int f32_lanes = 4;
+
+  static f32 load_f32(const float* p) { return _mm_loadu_ps(p); }
+  static void store_f32(float* p, f32 v) { _mm_storeu_ps(p, v); }
+  static f32 set_f32(float v) { return _mm_set1_ps(v); }
+
+  static f32 add_f32(f32 a, f32 b) { return _mm_add_ps(a, b); }
+  static f32 sub_f32(f32 a, f32 b) { return _mm_sub_ps(a, b); }
+  static f32 mul_f32(f32 a, f32 b) { return _mm_mul_ps(a, b); }
+  static f32 sqrt_f32(f32 a) { return _mm_sqrt_ps(a); }
+  static f32 abs_f32(f32 a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a); }
+
+  static f32 gt_f32(f32 a, f32 b) { return _mm_cmpgt_ps(a, b); }
+  static f32 select_f32(f32 mask, f32 a, f32 b) { return _mm_blendv_ps(b, a, mask); }
+  static f32 sign_f32(f32 a) { return _mm_and_ps(_mm_set1_ps(-0.f), a); }
+  static f32 or_f32(f32 a, f32 b) { return _mm_or_ps(a, b); }
+};
+#endif
+
+#if defined(__AVX2__)
+struct Avx2Ops
+{
+  static constexpr const char* name = "avx2";
+  static constexpr int lanes = 16;
+
+  using i16 = __m256i;
+  using i32 = __m256i;
+  using f32 = __m256;
+
+  static i16 load_u8(const uint8_t* p) { return _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))); }
+  static i16 load(const int16_t* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+  static void store(int16_t* p, i16 v) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v); }
+
+  static i16 set_pair(int16_t a, int16_t b) { return _mm256_set1_epi32(static_cast<int32_t>((uint32_t(uint16_t(b)) << 16) | uint16_t(a))); }
+
+  static i16 zip_lo(i16 a, i16 b) { return _mm256_unpacklo_epi16(a, b); }
+  static i16 zip_hi(i16 a, i16 b) { return _mm256_unpackhi_epi16(a, b); }
+
+  static i32 madd(i16 a, i16 b) { return _mm256_madd_epi16(a, b); }
+  static i32 add(i32 a, i32 b) { return _mm256_add_epi32(a, b); }
+
+  template<int Shift>
+  static i32 descale(i32 v) { return _mm256_srai_epi32(_mm256_add_epi32(v, _mm256_set1_epi32(1 << (Shift - 1))), Shift); }
+
+  // The pack instruction works per 128 bit lane, the permute restores the sequential order.
+  static i16 pack(i32 a, i32 b) { return _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8); }
+  static i16 pack_zipped(i32 lo, i32 hi) { return _mm256_packs_epi32(lo, hi); }
+
+  static i32 as_i32(i16 v) { return v; }
+  static i32 low16(i32 v) { return _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16); }
+  static i32 high16(i32 v) { return _mm256_srai_epi32(v, 16); }
+
+  static i16 subs(i16 a, i16 b) { return _mm256_subs_epi16(a, b); }
+
+  static f32 zero() { return _mm256_setzero_ps(); }
+  static f32 accumulate(f32 acc, i32 v) { return _mm256_add_ps(acc, _mm256_cvtepi32_ps(v)); }
+  static float sum(f32 v)
+  {
+    alignas(32) float values[8];
+    _mm256_store_ps(values, v);
+    return values[0] + values[1] + values[2] + values[3] + values[4] + values[5] + values[6] + values[7];
+  }
+
+  static constexpr int f32_lanes = 8;
+
+  static f32 load_f32(const float* p) { return _mm256_loadu_ps(p); }
+  static void store_f32(float* p, f32 v) { _mm256_storeu_ps(p, v); }
+  static f32 set_f32(float v) { return _mm256_set1_ps(v); }
+
+  static f32 add_f32(f32 a, f32 b) { return _mm256_add_ps(a, b); }
+  static f32 sub_f32(f32 a, f32 b) { return _mm256_sub_ps(a, b); }
+  static f32 mul_f32(f32 a, f32 b) { return _mm256_mul_ps(a, b); }
+  static f32 sqrt_f32(f32 a) { return _mm256_sqrt_ps(a); }
+  static f32 abs_f32(f32 a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a); }
+
+  static f32 gt_f32(f32 a, f32 b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+  static f32 select_f32(f32 mask, f32 a, f32 b) { return _mm256_blendv_ps(b, a, mask); }
+  static f32 sign_f32(f32 a) { return _mm256_and_ps(_mm256_set1_ps(-0.f), a); }
+  static f32 or_f32(f32 a, f32 b) { return _mm256_or_ps(a, b); }
+};
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+struct NeonOps
+{
+  static constexpr const char* name = "neon";
+  static constexpr int lanes = 8;
+
+  using i16 = int16x8_t;
+  using i32 = int32x4_t;
+  using f32 = float32x4_t;
+
+  static i16 load_u8(const uint8_t* p) { return vreinterpretq_s16_u16(vmovl_u8(vld1_u8(p))); }
+  static i16 load(const int16_t* p) { return vld1q_s16(p); }
+  static void store(int16_t* p, i16 v) { vst1q_s16(p, v); }
+
+  static i16 set_pair(int16_t a, int16_t b) { return vreinterpretq_s16_s32(vdupq_n_s32(static_cast<int32_t>((uint32_t(uint16_t(b)) << 16) | uint16_t(a)))); }
+
+  static i16 zip_lo(i16 a, i16 b) { return vzip1q_s16(a, b); }
+  static i16 zip_hi(i16 a, i16 b) { return vzip2q_s16(a, b); }
+
+  static i32 madd(i16 a, i16 b) { return vpaddq_s32(vmull_s16(vget_low_s16(a), vget_low_s16(b)), vmull_high_s16(a, b)); }
+  static i32 add(i32 a, i32 b) { return vaddq_s32(a, b); }
+
+  template<int Shift>
+  static i32 descale(i32 v) { return vrshrq_n_s32(v, Shift); }
+
+  static i16 pack(i32 a, i32 b) { return vcombine_s16(vqmovn_s32(a), vqmovn_s32(b)); }
+  static i16 pack_zipped(i32 lo, i32 hi) { return pack(lo, hi); }
+
+  static i32 as_i32(i16 v) { return vreinterpretq_s32_s16(v); }
+  static i32 low16(i32 v) { return vshrq_n_s32(vshlq_n_s32(v, 16), 16); }
+  static i32 high16(i32 v) { return vshrq_n_s32(v, 16); }
+
+  static i16 subs(i16 a, i16 b) { return vqsubq_s16(a, b); }
+
+  static f32 zero() { return vdupq_n_f32(0); }
+  static f32 accumulate(f32 acc, i32 v) { return vaddq_f32(acc, vcvtq_f32_s32(v)); }
+  static float sum(f32 v) { return vaddvq_f32(v); }
+
+  static constexpr int f32_lanes = 4;
+
+  static f32 load_f32(const float* p) { return vld1q_f32(p); }
+  static void store_f32(float* p, f32 v) { vst1q_f32(p, v); }
+  static f32 set_f32(float v) { return vdupq_n_f32(v); }
+
+  static f32 add_f32(f32 a, f32 b) { return vaddq_f32(a, b); }
+  static f32 sub_f32(f32 a, f32 b) { return vsubq_f32(a, b); }
+  static f32 mul_f32(f32 a, f32 b) { return vmulq_f32(a, b); }
+  static f32 sqrt_f32(f32 a) { return vsqrtq_f32(a); }
+  static f32 abs_f32(f32 a) { return vabsq_f32(a); }
+
+  static f32 gt_f32(f32 a, f32 b) { return vreinterpretq_f32_u32(vcgtq_f32(a, b)); }
+  static f32 select_f32(f32 mask, f32 a, f32 b) { return vbslq_f32(vreinterpretq_u32_f32(mask), a, b); }
+  static f32 sign_f32(f32 a) { return vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(a), vdupq_n_u32(0x80000000u))); }
+  static f32 or_f32(f32 a, f32 b) { return vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(a), vreinterpretq_u32_f32(b))); }
+};
+#endif
+
+#if defined(__AVX2__)
+using NativeOps = Avx2Ops;
+#elif defined(__SSE4_1__)
+using NativeOps = Sse41Ops;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+using NativeOps = NeonOps;
+#else
+using NativeOps = ScalarOps;
+#endif
+
+}
+
+#endif
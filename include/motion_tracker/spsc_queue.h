@@ -0,0 +1,75 @@
+#ifndef SpscQueue_h
+#define SpscQueue_h
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+// Bounded lock-free queue between exactly one producer and one consumer thread.
+//
+// The producer only writes tail_ and the consumer only writes head_; each side keeps a cached copy
+//  of the other's index and only reloads it (a cross-core transfer) when the cached value says
+//  the queue is full or empty.
+template<class T>
+class SpscQueue
+{
+public:
+  explicit SpscQueue(size_t capacity)
+    : slots_(std::max<size_t>(capacity, 1))
+  {}
+
+  SpscQueue(const SpscQueue&) = delete;
+  SpscQueue& operator=(const SpscQueue&) = delete;
+
+  // Producer side. <value> is moved from only if it was stored.
+  bool tryPush(T& value)
+  {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ == slots_.size())
+    {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail - cached_head_ == slots_.size())
+      {
+        return false;
+      }
+    }
+
+    slots_[tail % slots_.size()] = std::move(value);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side.
+  bool tryPop(T& value)
+  {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == cached_tail_)
+    {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head == cached_tail_)
+      {
+        return false;
+      }
+    }
+
+    value = std::move(slots_[head % slots_.size()]);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t capacity() const { return slots_.size(); }
+
+  // Only a snapshot, as both sides may be moving.
+  size_t size() const { return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire); }
+
+private:
+  std::vector<T> slots_;
+
+  alignas(64) std::atomic<size_t> head_{0};
+  size_t cached_tail_ = 0; // Consumer's copy of tail_
+
+  alignas(64) std::atomic<size_t> tail_{0};
+  size_t cached_head_ = 0; // Producer's copy of head_
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef Tracing_h
+#define Tracing_h
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+// Timeline of what every thread worked on, exported as Chrome trace-event JSON (chrome://tracing,
+//  ui.perfetto.dev) to find out where the time of a slow frame went.
+//
+// Each thread records its spans into its own ring buffer of the latest spans, so recording takes no
+//  lock. Tracing is off by default, in which case a span costs a relaxed atomic load.
+namespace tracing
+{
+  namespace detail
+  {
+    inline std::atomic<bool> enabled{false};
+  }
+
+  inline bool enabled() { return detail::enabled.load(std::memory_order_relaxed); }
+  void setEnabled(bool enabled);
+
+  // Names the calling thread in the traces
+  void setThreadName(const std::string& name);
+
+  // Returns a copy of <name> which lives until the end of the process, for spans named at runtime.
+  const char* intern(const std::string& name);
+
+  // <name> has to outlive the trace: a string literal, or a name from intern().
+  void record(const char* name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end);
+
+  // Records the time until it goes out of scope, if tracing is enabled
+  class Span
+  {
+  public:
+    explicit Span(const char* name)
+      : name_(enabled() ? name : nullptr)
+    {
+      if (name_ != nullptr)
+      {
+        start_ = std::chrono::steady_clock::now();
+      }
+    }
+
+    ~Span()
+    {
+      if (name_ != nullptr)
+      {
+        record(name_, start_, std::chrono::steady_clock::now());
+      }
+    }
+
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+
+  private:
+    const char* const name_;
+    std::chrono::steady_clock::time_point start_;
+  };
+
+  // The spans still in the threads' rings, as a trace-event JSON document
+  std::string chromeTraceJson();
+
+  // Writes chromeTraceJson() to <path>, returns false if it could not be written.
+  bool dump(const std::string& path);
+}
+
+#endif
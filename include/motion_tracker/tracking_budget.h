@@ -0,0 +1,52 @@
+#ifndef TrackingBudget_h
+#define TrackingBudget_h
+
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+// The amount of work a tracker may spend on a frame.
+struct TrackingBudget
+{
+  size_t num_points;
+  int window_size;                 // LK window [px], at most the window the pyramids are built for
+  unsigned int detection_interval; // New corners are searched for on every n-th frame
+};
+
+// Keeps the processing time of the frames within <target_period> by trading tracking quality for
+//  time. The budgets form a ladder of degradation levels, starting from <full_budget> (level 0):
+//  the point count shrinks first, then the window size, and the corner detection runs less often.
+//
+// The frame time is smoothed, and the controller steps one level down as soon as the smoothed time
+//  misses the deadline, but waits for a sustained margin before stepping back up, so it does not
+//  oscillate around the target.
+class BudgetController
+{
+public:
+  using Duration = std::chrono::steady_clock::duration;
+
+  BudgetController(Duration target_period, const TrackingBudget& full_budget);
+
+  // Feeds the processing time of the last frame, returns the budget for the next one.
+  const TrackingBudget& update(Duration frame_time);
+
+  const TrackingBudget& budget() const { return levels_[level_]; }
+
+  // 0 at full budget, up to maxDegradationLevel() at the cheapest one.
+  size_t degradationLevel() const { return level_; }
+  size_t maxDegradationLevel() const { return levels_.size() - 1; }
+
+  // Smoothed frame time as a fraction of the target period.
+  double load() const { return smoothed_time_ / target_period_; }
+
+private:
+  const double target_period_; // [s]
+  std::vector<TrackingBudget> levels_;
+
+  size_t level_;
+  double smoothed_time_;       // [s]
+  unsigned int settle_frames_; // Frames to wait before the effect of the last change is judged
+  unsigned int fast_frames_;   // Consecutive frames with enough margin to step back up
+};
+
+#endif
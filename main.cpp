@@ -1,15 +1,19 @@
 #include <iostream>
+#include <sstream>
 #include <future>
+#include <thread>
 
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 
 #include <motion_tracker/camera/camera.h>
-#include <motion_tracker/optic_flow_tracker.h>
-#include <motion_tracker/motion_estimation.h>
+#include <motion_tracker/camera/replay_camera.h>
+#include <motion_tracker/camera/frame_recorder.h>
+#include <motion_tracker/odometry_host.h>
+#include <motion_tracker/metrics.h>
+#include <motion_tracker/tracing.h>
 
 #include <cpp-toolkit/thread_pool.h>
-#include <cpp-toolkit/moving_average.h>
 #include <motion_tracker/web_viewer.h>
 
 static std::vector<cv::Scalar> color_data;
@@ -47,98 +51,283 @@ cv::Mat mark(const cv::Mat& frame, const std::vector<Point2f>& points)
   return img;
 }
 
-cv::Mat mark(const cv::Mat& frame, const std::vector<OpticFlow>& flow_pairs, Vector2f offset = Vector2f(0, 0))
+void mark(const cv::Mat& frame, cv::Mat& img, cv::Mat& mask, const FlowBatch& flow)
 {
-  cv::Mat mask = cv::Mat::zeros(frame.size(), frame.type());
+  mask.create(frame.size(), frame.type());
+  mask.setTo(cv::Scalar::all(0));
 
-  size_t i = 0;
-  for (const auto& flow : flow_pairs)
+  size_t color = 0;
+  for (size_t i = 0; i < flow.size(); ++i)
   {
-    const auto start = flow.start + offset;
-    const auto end = flow.end + offset;
+    if (!flow.isValid(i))
+    {
+      continue;
+    }
 
-    cv::Point start_point(start.x, start.y);
-    cv::Point end_point(end.x, end.y);
-    line(mask, start_point, end_point, getColors()[i], 2);
-    circle(mask, end_point, 5, getColors()[i++], -1);
+    cv::Point2f start_point(flow.start_x[i], flow.start_y[i]);
+    cv::Point2f end_point(flow.end_x[i], flow.end_y[i]);
+    line(mask, start_point, end_point, getColors()[color], 2);
+    circle(mask, end_point, 5, getColors()[color++], -1);
   }
 
-  cv::Mat img;
   add(frame, mask, img);
-  return img;
 }
 
-int main()
+struct Options
 {
-//  CameraConfig camera_conf(85*M_PI/180, 55*M_PI/180, 1080, 1920, -90*M_PI/180.0, 0, 0.2);
-  CameraConfig camera_conf(85*M_PI/180, 55*M_PI/180, 640, 480, 0*M_PI/180.0, 0, 0.2);
-  Camera cam(camera_conf, CameraCalibration("calib.json"), 0);
-
-  WebViewer viewer("lo0");
-  viewer.run(8080);
+  std::vector<std::string> replay_paths;
+  std::vector<int> camera_ids;
+  bool max_speed = false;
+  std::string record_path;
+  ChannelSettings channel;
+  size_t workers = 0;
+  size_t shown_camera = 0;
+  bool trace = false;
+};
+
+// Parses "<name>,<start x>,<start y>,<end x>,<end y>,<yaw|speed|both>,<points>[,<decimation>[,<rate [Hz]>]]".
+static std::optional<TrackedRegion> parseRegion(const std::string& text)
+{
+  std::vector<std::string> fields;
+  std::stringstream stream(text);
+  for (std::string field; std::getline(stream, field, ',');)
+  {
+    fields.push_back(field);
+  }
 
-  const char *window_name = "img";
-  namedWindow(window_name, cv::WINDOW_AUTOSIZE);
+  if (fields.size() < 7 || fields.size() > 9)
+  {
+    printf("WARNING: Invalid region \"%s\", it is ignored!\n", text.c_str());
+    return std::nullopt;
+  }
 
-  auto initial_frame = cam.grab()->toGray();
+  TrackedRegion region;
+  region.name = fields[0];
+  region.roi = Rect<unsigned int>(std::stoul(fields[1]), std::stoul(fields[2]), std::stoul(fields[3]), std::stoul(fields[4]));
+  region.role = fields[5] == "yaw" ? TrackedRegion::Role::Yaw : (fields[5] == "speed" ? TrackedRegion::Role::Speed : TrackedRegion::Role::Both);
+  region.num_points = std::stoul(fields[6]);
+  region.decimation = fields.size() > 7 ? std::stoul(fields[7]) : 1;
+  region.rate = fields.size() > 8 ? std::stod(fields[8]) : 0;
+  return region;
+}
 
-  auto size_x = initial_frame.data().cols;
+// Usage: app [<recording>...] [--camera <id>...] [--max-speed] [--record <frame log>] [--lk <opencv|specialized>]
+//  [--target-fps <fps>] [--detector <shi-tomasi|fast|agast>] [--scale <tracking resolution factor> [--refine]]
+//  [--yaw-rate <Hz>] [--speed-rate <Hz>] [--region <region>...] [--workers <threads>] [--show <camera index>]
+//  [--trace] [--trace-slow <frame latency [ms]>]
+//
+// Every recording and camera id adds a camera, all of them run in the same process; without any, the
+//  camera 0 is used. Every --region adds a region tracked on every camera (see parseRegion()),
+//  without any, the upper half of the frame is tracked for the turn rate at --yaw-rate and the lower
+//  half for the speed at --speed-rate. With tracing enabled, the viewer serves the trace at /trace,
+//  and --trace-slow writes it to a file whenever a frame is slower than the given latency.
+static Options parseOptions(int argc, char** argv)
+{
+  Options options;
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg(argv[i]);
+    if (arg == "--max-speed")
+    {
+      options.max_speed = true;
+    }
+    else if (arg == "--record" && i + 1 < argc)
+    {
+      options.record_path = argv[++i];
+    }
+    else if (arg == "--target-fps" && i + 1 < argc)
+    {
+      options.channel.target_fps = std::stod(argv[++i]);
+    }
+    else if (arg == "--detector" && i + 1 < argc)
+    {
+      std::string detector(argv[++i]);
+      options.channel.detector = detector == "fast" ? FeatureDetector::Type::Fast :
+        (detector == "agast" ? FeatureDetector::Type::Agast : FeatureDetector::Type::ShiTomasi);
+    }
+    else if (arg == "--scale" && i + 1 < argc)
+    {
+      options.channel.tracking_scale = std::stod(argv[++i]);
+    }
+    else if (arg == "--yaw-rate" && i + 1 < argc)
+    {
+      options.channel.yaw_rate = std::stod(argv[++i]);
+    }
+    else if (arg == "--speed-rate" && i + 1 < argc)
+    {
+      options.channel.speed_rate = std::stod(argv[++i]);
+    }
+    else if (arg == "--region" && i + 1 < argc)
+    {
+      auto region = parseRegion(argv[++i]);
+      if (region.has_value())
+      {
+        options.channel.regions.push_back(std::move(region.value()));
+      }
+    }
+    else if (arg == "--refine")
+    {
+      options.channel.refine = true;
+    }
+    else if (arg == "--lk" && i + 1 < argc)
+    {
+      options.channel.lk_engine = std::string(argv[++i]) == "specialized" ? LkEngine::Specialized : LkEngine::OpenCV;
+    }
+    else if (arg == "--camera" && i + 1 < argc)
+    {
+      options.camera_ids.push_back(std::stoi(argv[++i]));
+    }
+    else if (arg == "--workers" && i + 1 < argc)
+    {
+      options.workers = std::stoul(argv[++i]);
+    }
+    else if (arg == "--trace")
+    {
+      options.trace = true;
+    }
+    else if (arg == "--trace-slow" && i + 1 < argc)
+    {
+      options.trace = true;
+      options.channel.trace_slow_frame = std::stod(argv[++i]);
+    }
+    else if (arg == "--show" && i + 1 < argc)
+    {
+      options.shown_camera = std::stoul(argv[++i]);
+    }
+    else
+    {
+      options.replay_paths.push_back(arg);
+    }
+  }
+  if (options.replay_paths.empty() && options.camera_ids.empty())
+  {
+    options.camera_ids.push_back(0);
+  }
+  return options;
+}
 
-  constexpr size_t num_tracked_points = 200;
+static std::unique_ptr<FrameSource> openReplay(const CameraConfig& camera_conf, const std::string& path, const Options& options)
+{
+  return std::make_unique<ReplayCamera>(camera_conf, path, options.max_speed ? ReplayCamera::Mode::MaxSpeed : ReplayCamera::Mode::RealTime);
+}
 
-  OpticFlowTracker tracker_top(initial_frame, Rect<unsigned int>(0, 0, size_x, 240), num_tracked_points);
-  OpticFlowTracker tracker_bottom(initial_frame, Rect<unsigned int>(0, 241, size_x, 480), num_tracked_points);
+static std::unique_ptr<FrameSource> openCamera(const CameraConfig& camera_conf, int camera_id)
+{
+  auto camera = std::make_unique<Camera>(camera_conf, CameraCalibration("calib.json"), camera_id);
+  camera->setPixelFormat(Frame::PixelFormat::Gray);
+  camera->startCapture(4, FrameRing::OverflowPolicy::DropOldest);
+  return camera;
+}
 
-  Vector2f bottom_offset(0, 240);
-  ThreadPool workers(4);
+// With several cameras, each one records into its own log, suffixed with its index
+static std::unique_ptr<FrameRecorder> openRecorder(const Options& options, size_t camera, size_t num_cameras)
+{
+  constexpr size_t max_recorded_frames = 1800;
+  if (options.record_path.empty())
+  {
+    return nullptr;
+  }
+  std::string path = num_cameras > 1 ? options.record_path + "." + std::to_string(camera) : options.record_path;
+  return std::make_unique<FrameRecorder>(path, max_recorded_frames);
+}
 
-  MovingAverage<double, 3> turn_rate_filter;
-  MovingAverage<double, 3> linear_speed_filter;
+int main(int argc, char** argv)
+{
+//  CameraConfig camera_conf(85*M_PI/180, 55*M_PI/180, 1080, 1920, -90*M_PI/180.0, 0, 0.2);
+  CameraConfig camera_conf(85*M_PI/180, 55*M_PI/180, 640, 480, 0*M_PI/180.0, 0, 0.2);
+  auto options = parseOptions(argc, argv);
+  tracing::setEnabled(options.trace);
 
-  double total_turn = 0;
-  double total_dist = 0;
+  // One pool does the tracking of all the cameras
+  OdometryHost host(options.workers);
 
-  while (viewer.running())
+  size_t num_cameras = options.replay_paths.size() + options.camera_ids.size();
+  for (const auto& path : options.replay_paths)
+  {
+    host.addCamera(openReplay(camera_conf, path, options), options.channel, openRecorder(options, host.numCameras(), num_cameras));
+  }
+  for (int camera_id : options.camera_ids)
   {
-    auto ref_time = std::chrono::system_clock::now();
+    // A live camera drops the frames the stages can not keep up with, a replay waits for them
+    ChannelSettings settings = options.channel;
+    settings.drop_frames = true;
+    host.addCamera(openCamera(camera_conf, camera_id), settings, openRecorder(options, host.numCameras(), num_cameras));
+  }
 
-    auto frame = cam.grab();
-    if (!frame.has_value())
-    {
-      break;
-    }
-    cv::imwrite("debug1.jpg", frame->data(), {cv::IMWRITE_JPEG_QUALITY, 30});
-    auto gray_frame = frame->toGray();
+  WebViewer viewer("lo0");
+  viewer.run(8080);
 
-    auto flow_top_task = tracker_top.packageCalculation(gray_frame);
-    auto flow_bottom_task = tracker_bottom.packageCalculation(gray_frame);
+  const char *window_name = "img";
+  namedWindow(window_name, cv::WINDOW_AUTOSIZE);
 
-    workers.addWork([&flow_top_task](){ flow_top_task(); });
-    workers.addWork([&flow_bottom_task](){ flow_bottom_task(); });
+  if (options.channel.lk_engine == LkEngine::Specialized)
+  {
+    cv::Size lk_window(OpticFlowTracker::window_size, OpticFlowTracker::window_size);
+    printf("Specialized LK kernels (%s): %s\n", specializedKernelInstructionSet(),
+      hasSpecializedKernel(lk_window, OpticFlowTracker::pyramid_levels) ? "in use" : "not available, using OpenCV");
+  }
 
-    auto flow_top = flow_top_task.get_future().get();
-    auto flow_bottom = flow_bottom_task.get_future().get();
+  // Buffers reused across frames, so the steady state publishing does not allocate for them. Only
+  //  the shown camera draws into them.
+  cv::Mat disp_color, disp_top, disp, overlay_mask;
 
-    auto disp_top = mark(frame->data(), flow_top);
-    auto disp = mark(disp_top, flow_bottom, bottom_offset);
+  bool all_started = host.run([&](FramePacket& packet)
+  {
+    if (!viewer.running())
+    {
+      host.stop();
+      return;
+    }
 
-    double yaw_speed = turn_rate_filter.push(getTurnRateFromFlow(cam.config(), flow_top));
-    double linear_speed = linear_speed_filter.push(getSpeedFromFlow(cam.config(), flow_bottom, yaw_speed));
+    auto odometry = host.odometry();
+    printf("Camera %zu FPS: %.3f Yaw speed: %.5f [deg/s] (age %.0f [ms]) linear: %.3f [m/s] (age %.0f [ms]) load: %.2f degradation: %zu/%zu latency: %.1f [ms]"
+      " | all %zu: %.5f [deg/s] %.3f [m/s] total: %.2f [deg] %.2f [m]\n",
+      packet.camera, packet.fps, packet.yaw_speed * 180 / M_PI, packet.yaw_speed_age * 1000, packet.linear_speed, packet.linear_speed_age * 1000,
+      packet.load, packet.degradation, host.camera(packet.camera).maxDegradationLevel(), packet.latency,
+      odometry.cameras, odometry.turn_rate * 180 / M_PI, odometry.speed, odometry.total_turn*180/M_PI, odometry.total_dist);
 
+    if (packet.camera != options.shown_camera)
+    {
+      return;
+    }
 
-    double dt = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - ref_time).count() / 1000.0;
-    total_turn += yaw_speed * dt;
-    total_dist += linear_speed * dt;
+    // The tracking only needs the gray image, the colors are added for the overlay alone
+    if (packet.frame.format() == Frame::PixelFormat::Gray)
+    {
+      cv::cvtColor(packet.frame.data(), disp_color, cv::COLOR_GRAY2BGR);
+    }
+    else
+    {
+      disp_color = packet.frame.data();
+    }
+
+    // Drawn after the estimation, so only the vectors it could use are shown
+    {
+      metrics::ScopedLatency latency(metrics::Stage::OverlayRendering);
+      mark(disp_color, disp_top, overlay_mask, packet.flows.rotation);
+      mark(disp_top, disp, overlay_mask, packet.flows.translation);
+    }
 
     viewer.updateFrame(disp, {
-      {"x", std::to_string(linear_speed)},
-      {"y", std::to_string(1.0 / dt)},
-      {"th", std::to_string(yaw_speed)}
+      {"x", std::to_string(odometry.speed)},
+      {"y", std::to_string(packet.fps)},
+      {"th", std::to_string(odometry.turn_rate)},
+      {"degradation", std::to_string(packet.degradation)}
       });
-    printf("FPS: %.3f Yaw speed: %.5f [deg/s] linear: %.3f [m/s] total: %.2f [deg] %.2f [m]\n", 1.0 / dt, yaw_speed * 180 / M_PI, linear_speed, total_turn*180/M_PI, total_dist);
+  });
+
+  for (size_t i = 0; i < host.numCameras(); ++i)
+  {
+    const auto& camera = host.camera(i);
+    auto latency = camera.latency();
+    printf("Camera %zu: %zu frames, latency mean %.1f [ms] max %.1f [ms]\n", i, latency.frames, latency.mean, latency.max);
+    for (const auto& stage : camera.stageStats())
+    {
+      printf("  Stage %s: %zu frames processed, %zu dropped\n", stage.name.c_str(), stage.processed, stage.dropped);
+    }
   }
 
-  printf("Total heading change: %.2f deg\n", total_turn*180/M_PI);
+  printf("Total heading change: %.2f deg\n", host.odometry().total_turn*180/M_PI);
 
-  return 0;
+  return all_started ? 0 : 1;
 }
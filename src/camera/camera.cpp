@@ -1,12 +1,18 @@
 #include <motion_tracker/camera/camera.h>
+#include <motion_tracker/metrics.h>
+#include <motion_tracker/tracing.h>
 
 #include <opencv2/videoio.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <tuple>
+#include <algorithm>
+#include <thread>
+#include <atomic>
 #include <opencv2/calib3d.hpp>
+#include <opencv2/imgcodecs.hpp>
 
 template<class T>
-static std::tuple<std::unique_ptr<cv::VideoCapture>, cv::Mat, cv::Rect2f> getCameraParams(double cam_angle, T device_params)
+static std::tuple<std::unique_ptr<cv::VideoCapture>, cv::Mat, cv::Rect2f, cv::Size> getCameraParams(double cam_angle, T device_params)
 {
   auto capture_device = std::make_unique<cv::VideoCapture>(device_params, cv::CAP_ANY);
 
@@ -26,32 +32,196 @@ static std::tuple<std::unique_ptr<cv::VideoCapture>, cv::Mat, cv::Rect2f> getCam
 
   printf("Cam angle: %.3f Rotated size: %.3f/%.3f\n", cam_angle, result_frame_size.x, result_frame_size.y);
 
-  return std::tuple<std::unique_ptr<cv::VideoCapture>, cv::Mat, cv::Rect2f>(std::move(capture_device), std::move(rot), std::move(result_frame_size));
+  return std::tuple<std::unique_ptr<cv::VideoCapture>, cv::Mat, cv::Rect2f, cv::Size>(std::move(capture_device), std::move(rot), std::move(result_frame_size), frame.size());
+}
+
+// Builds the per-pixel source lookup of the corrected output frame: every output pixel is first
+//  rotated back by the inverse of the roll correction, and the resulting (undistorted) position is
+//  then mapped to its location in the raw, distorted camera image. The result is converted to the
+//  fixed-point representation of cv::remap, so a single remap pass per frame does both corrections.
+static std::pair<cv::Mat, cv::Mat> buildCorrectionMaps(const cv::Size& frame_size, const cv::Mat& rotation_matrix, const cv::Size& rotated_size, const CameraCalibration& calibration)
+{
+  cv::Mat inverse_rotation;
+  cv::invertAffineTransform(rotation_matrix, inverse_rotation);
+
+  cv::Mat undistort_map_x, undistort_map_y;
+  if (calibration.valid())
+  {
+    cv::initUndistortRectifyMap(calibration.camera_matrix, calibration.dist_coeffs, cv::Mat(), calibration.camera_matrix,
+      frame_size, CV_32FC1, undistort_map_x, undistort_map_y);
+  }
+
+  const double m00 = inverse_rotation.at<double>(0, 0);
+  const double m01 = inverse_rotation.at<double>(0, 1);
+  const double m02 = inverse_rotation.at<double>(0, 2);
+  const double m10 = inverse_rotation.at<double>(1, 0);
+  const double m11 = inverse_rotation.at<double>(1, 1);
+  const double m12 = inverse_rotation.at<double>(1, 2);
+
+  cv::Mat map_x(rotated_size, CV_32FC1);
+  cv::Mat map_y(rotated_size, CV_32FC1);
+
+  for (int row = 0; row < rotated_size.height; ++row)
+  {
+    float* map_x_row = map_x.ptr<float>(row);
+    float* map_y_row = map_y.ptr<float>(row);
+
+    for (int col = 0; col < rotated_size.width; ++col)
+    {
+      float x = m00 * col + m01 * row + m02;
+      float y = m10 * col + m11 * row + m12;
+
+      if (calibration.valid())
+      {
+        // Pixels rotated in from outside of the frame stay outside, so remap fills them with the border value.
+        if (x < 0 || y < 0 || x > frame_size.width - 1 || y > frame_size.height - 1)
+        {
+          map_x_row[col] = -1;
+          map_y_row[col] = -1;
+          continue;
+        }
+
+        int x0 = std::min(static_cast<int>(x), frame_size.width - 2);
+        int y0 = std::min(static_cast<int>(y), frame_size.height - 2);
+        float a = x - x0;
+        float b = y - y0;
+
+        auto interpolate = [&](const cv::Mat& map)
+        {
+          const float* top = map.ptr<float>(y0) + x0;
+          const float* bottom = map.ptr<float>(y0 + 1) + x0;
+          return (1 - b) * ((1 - a) * top[0] + a * top[1]) + b * ((1 - a) * bottom[0] + a * bottom[1]);
+        };
+
+        x = interpolate(undistort_map_x);
+        y = interpolate(undistort_map_y);
+      }
+
+      map_x_row[col] = x;
+      map_y_row[col] = y;
+    }
+  }
+
+  cv::Mat fixed_map_xy, fixed_map_interpolation;
+  cv::convertMaps(map_x, map_y, fixed_map_xy, fixed_map_interpolation, CV_16SC2);
+
+  return std::make_pair(std::move(fixed_map_xy), std::move(fixed_map_interpolation));
 }
 
 struct Camera::Internals
 {
-  Internals(std::tuple<std::unique_ptr<cv::VideoCapture>, cv::Mat, cv::Rect2f> params)
+  Internals(std::tuple<std::unique_ptr<cv::VideoCapture>, cv::Mat, cv::Rect2f, cv::Size> params, const CameraCalibration& calibration)
     : capture_device(std::move(std::get<0>(params)))
       , rotation_matrix(std::move(std::get<1>(params)))
       , rotated_size(std::move(std::get<2>(params)))
+      , frame_size(std::get<3>(params))
+      , correction_maps(buildCorrectionMaps(std::get<3>(params), rotation_matrix, rotated_size.size(), calibration))
+      , frame_pool(frame_pool_size)
   {}
 
-  Internals(std::unique_ptr<cv::VideoCapture> cap, const cv::Mat& rotation_matrix, const cv::Rect2f& rotated_size)
-    : capture_device(std::move(cap))
-      , rotation_matrix(rotation_matrix)
-      , rotated_size(rotated_size)
-  {}
+  static constexpr size_t frame_pool_size = 16;
 
   const std::unique_ptr<cv::VideoCapture> capture_device;
   const cv::Mat rotation_matrix;
   const cv::Rect2f rotated_size;
+  const cv::Size frame_size;
+
+  // Fixed-point (CV_16SC2 + CV_16UC1) remap tables combining undistortion and roll correction.
+  const std::pair<cv::Mat, cv::Mat> correction_maps;
+
+  Frame::PixelFormat pixel_format = Frame::PixelFormat::BGR;
+
+  cv::Mat raw_frame;
+  cv::Mat luma_frame;
+  FramePool frame_pool;
+
+  std::atomic<size_t> undecodable_frames{0};
+
+  // Offset between the device clock (CAP_PROP_POS_MSEC) and the steady clock, set on the first stamped frame.
+  std::optional<std::chrono::steady_clock::duration> device_clock_offset;
+  std::chrono::steady_clock::duration last_device_time{};
+
+  std::unique_ptr<FrameRing> ring;
+  std::thread capture_thread;
+  std::atomic_bool capturing{false};
 };
 
+static Frame::TimeStamp getFrameStamp(cv::VideoCapture& capture_device, std::optional<std::chrono::steady_clock::duration>& clock_offset,
+  std::chrono::steady_clock::duration& last_device_time)
+{
+  auto now = std::chrono::steady_clock::now();
+
+  double device_msec = capture_device.get(cv::CAP_PROP_POS_MSEC);
+  if (!(device_msec > 0))
+  {
+    // The backend does not report timestamps, the best we have is the time the frame was grabbed.
+    return now;
+  }
+
+  auto device_time = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(device_msec));
+
+  // Anchor the device clock to the steady clock on the first frame, and again if it jumps back (e.g. a looping video file).
+  if (!clock_offset || device_time < last_device_time)
+  {
+    clock_offset = now.time_since_epoch() - device_time;
+  }
+  last_device_time = device_time;
+
+  return Frame::TimeStamp(*clock_offset + device_time);
+}
+
+// Consecutive frames which could not be decoded after which the device is given up on
+static constexpr size_t max_undecodable_in_a_row = 30;
+
+// Planar 4:2:0 formats, which start with the full resolution luma plane
+static bool isPlanarYuv(int fourcc)
+{
+  return fourcc == cv::VideoWriter::fourcc('N', 'V', '1', '2') || fourcc == cv::VideoWriter::fourcc('N', 'V', '2', '1') ||
+    fourcc == cv::VideoWriter::fourcc('I', '4', '2', '0') || fourcc == cv::VideoWriter::fourcc('I', 'Y', 'U', 'V') ||
+    fourcc == cv::VideoWriter::fourcc('Y', 'V', '1', '2');
+}
+
+// Returns the luma plane of a raw (unconverted) device frame, using <luma> as storage when needed.
+//  The result is empty if the frame could not be decoded.
+static const cv::Mat& extractLuma(const cv::Mat& raw, const cv::Size& frame_size, int fourcc, cv::Mat& luma)
+{
+  if (raw.type() == CV_8UC1 && raw.size() == frame_size)
+  {
+    return raw; // GREY/Y8 devices
+  }
+
+  if (raw.type() == CV_8UC1 && raw.cols == frame_size.width && raw.rows > frame_size.height &&
+      (isPlanarYuv(fourcc) || raw.rows == frame_size.height * 3 / 2))
+  {
+    // The chroma planes follow the luma plane, which is referenced without a copy
+    luma = raw.rowRange(0, frame_size.height);
+    return luma;
+  }
+
+  if (raw.type() == CV_8UC1)
+  {
+    // Compressed (MJPEG) buffer, decode the luma only
+    cv::imdecode(raw, cv::IMREAD_GRAYSCALE, &luma);
+    return luma;
+  }
+
+  if (raw.type() == CV_8UC2)
+  {
+    // Packed 4:2:2 formats, the luma is either the first (YUYV) or the second (UYVY) byte of each pixel
+    int luma_channel = (fourcc == cv::VideoWriter::fourcc('U', 'Y', 'V', 'Y')) ? 1 : 0;
+    cv::extractChannel(raw, luma, luma_channel);
+    return luma;
+  }
+
+  // The backend converted to BGR regardless, so at least convert before the correction
+  cv::cvtColor(raw, luma, raw.channels() == 4 ? cv::COLOR_BGRA2GRAY : cv::COLOR_BGR2GRAY);
+  return luma;
+}
+
 Camera::Camera(CameraConfig config, CameraCalibration calibration)
   : config_(config)
   , calibration_(calibration)
-  , internals_(std::make_unique<Internals>(getCameraParams(config.camera_roll*180/M_PI, "0")))
+  , internals_(std::make_unique<Internals>(getCameraParams(config.camera_roll*180/M_PI, "0"), calibration))
 {
   config_ = CameraConfig(config.v_fov, config.h_fov, internals_->rotated_size.x, internals_->rotated_size.y, config.camera_roll, config.camera_pitch, config.ground_height);
 }
@@ -59,7 +229,7 @@ Camera::Camera(CameraConfig config, CameraCalibration calibration)
 Camera::Camera(CameraConfig config, CameraCalibration calibration, int camera_id)
   : config_(config)
   , calibration_(calibration)
-  , internals_(std::make_unique<Internals>(getCameraParams(config.camera_roll*180/M_PI, std::to_string(camera_id))))
+  , internals_(std::make_unique<Internals>(getCameraParams(config.camera_roll*180/M_PI, std::to_string(camera_id)), calibration))
 {
   config_ = CameraConfig(config.v_fov, config.h_fov, internals_->rotated_size.x, internals_->rotated_size.y, config.camera_roll, config.camera_pitch, config.ground_height);
 }
@@ -67,32 +237,157 @@ Camera::Camera(CameraConfig config, CameraCalibration calibration, int camera_id
 Camera::Camera(CameraConfig config, CameraCalibration calibration, const std::string& video_src)
   : config_(config)
   , calibration_(calibration)
-  , internals_(std::make_unique<Internals>(getCameraParams(config.camera_roll*180/M_PI, video_src)))
+  , internals_(std::make_unique<Internals>(getCameraParams(config.camera_roll*180/M_PI, video_src), calibration))
 {
   config_ = CameraConfig(config.v_fov, config.h_fov, internals_->rotated_size.x, internals_->rotated_size.y, config.camera_roll, config.camera_pitch, config.ground_height);
 }
 
-Camera::~Camera() = default;
+Camera::~Camera()
+{
+  stopCapture();
+}
 
-std::optional<Frame> Camera::grab()
+void Camera::setPixelFormat(Frame::PixelFormat format)
 {
-  if (!internals_->capture_device->grab())
+  if (internals_->capturing)
   {
-    return std::nullopt;
+    printf("WARNING: The pixel format cannot be changed while the capture thread is running!\n");
+    return;
   }
 
-  cv::Mat cv_frame, cv_corrected, cv_rotated;
-  internals_->capture_device->retrieve(cv_frame);
+  // With RGB conversion disabled, the backend hands over the device's native (typically YUV) buffer.
+  internals_->capture_device->set(cv::CAP_PROP_CONVERT_RGB, format == Frame::PixelFormat::Gray ? 0 : 1);
+  internals_->pixel_format = format;
+}
+
+Frame::PixelFormat Camera::pixelFormat() const
+{
+  return internals_->pixel_format;
+}
+
+void Camera::startCapture(size_t buffer_size, FrameRing::OverflowPolicy policy)
+{
+  if (internals_->capturing)
+  {
+    return;
+  }
+
+  internals_->ring = std::make_unique<FrameRing>(buffer_size, policy);
+  internals_->capturing = true;
+  internals_->capture_thread = std::thread([&]()
+    {
+      tracing::setThreadName("capture");
+      while (internals_->capturing)
+      {
+        auto frame = capture();
+        if (!frame.has_value() || !internals_->ring->push(std::move(frame.value())))
+        {
+          break;
+        }
+      }
+      internals_->ring->close();
+    });
+}
+
+void Camera::stopCapture()
+{
+  if (!internals_->capture_thread.joinable())
+  {
+    return;
+  }
+
+  internals_->capturing = false;
+  internals_->ring->close();
+  internals_->capture_thread.join();
+  internals_->ring.reset();
+}
 
-  if (calibration_.valid())
+std::optional<Frame> Camera::grab()
+{
+  tracing::Span span("Camera::grab");
+  if (internals_->ring)
   {
-    cv::undistort(cv_frame, cv_corrected, calibration_.camera_matrix, calibration_.dist_coeffs);
-    warpAffine(cv_corrected, cv_rotated, internals_->rotation_matrix, internals_->rotated_size.size());
+    return internals_->ring->pop();
   }
-  else
+  return capture();
+}
+
+std::optional<Frame> Camera::latest()
+{
+  if (internals_->ring)
   {
-    warpAffine(cv_frame, cv_rotated, internals_->rotation_matrix, internals_->rotated_size.size());
+    return internals_->ring->popLatest();
   }
+  return capture();
+}
 
-  return std::optional<Frame>(std::move(cv_rotated));
+FramePool& Camera::pool()
+{
+  return internals_->frame_pool;
+}
+
+size_t Camera::droppedFrames() const
+{
+  return internals_->ring ? internals_->ring->dropped() : 0;
+}
+
+size_t Camera::undecodableFrames() const
+{
+  return internals_->undecodable_frames;
+}
+
+std::optional<Frame> Camera::capture()
+{
+  tracing::Span span("Camera::capture");
+
+  // A frame which can not be decoded (e.g. a corrupt MJPEG buffer) is skipped. A device none of
+  //  whose frames can be decoded ends the stream though, rather than keeping the caller waiting.
+  size_t undecodable_in_a_row = 0;
+  while (true)
+  {
+    auto grab_start = std::chrono::steady_clock::now();
+    if (!internals_->capture_device->grab())
+    {
+      return std::nullopt;
+    }
+
+    auto stamp = getFrameStamp(*internals_->capture_device, internals_->device_clock_offset, internals_->last_device_time);
+
+    // The raw buffer is reused between frames, and the corrected one is recycled through the pool.
+    internals_->capture_device->retrieve(internals_->raw_frame);
+    metrics::record(metrics::Stage::Grab, std::chrono::steady_clock::now() - grab_start);
+
+    const cv::Mat* source = &internals_->raw_frame;
+    if (internals_->pixel_format == Frame::PixelFormat::Gray)
+    {
+      metrics::ScopedLatency latency(metrics::Stage::GrayConversion);
+      int fourcc = static_cast<int>(internals_->capture_device->get(cv::CAP_PROP_FOURCC));
+      source = &extractLuma(internals_->raw_frame, internals_->frame_size, fourcc, internals_->luma_frame);
+    }
+
+    if (source->empty())
+    {
+      if (internals_->undecodable_frames++ == 0)
+      {
+        printf("WARNING: Skipping a camera frame which could not be decoded!\n");
+      }
+      if (++undecodable_in_a_row >= max_undecodable_in_a_row)
+      {
+        printf("WARNING: %zu camera frames in a row could not be decoded, ending the capture!\n", undecodable_in_a_row);
+        return std::nullopt;
+      }
+      // The capture thread is being stopped
+      if (internals_->ring && !internals_->capturing)
+      {
+        return std::nullopt;
+      }
+      continue;
+    }
+
+    metrics::ScopedLatency latency(metrics::Stage::Undistort);
+    cv::Mat cv_corrected = internals_->frame_pool.acquire(internals_->correction_maps.first.size(), source->type());
+    cv::remap(*source, cv_corrected, internals_->correction_maps.first, internals_->correction_maps.second, cv::INTER_LINEAR);
+
+    return std::optional<Frame>(Frame(std::move(cv_corrected), stamp, internals_->pixel_format));
+  }
 }
@@ -1,4 +1,5 @@
 #include <motion_tracker/camera/camera_frame.h>
+#include <motion_tracker/metrics.h>
 #include <opencv2/imgproc.hpp>
 #include <cmath>
 
@@ -9,10 +10,35 @@ Frame Frame::toGray() const
     return Frame();
   }
 
+  if (format_ == PixelFormat::Gray)
+  {
+    return *this;
+  }
+
+  metrics::ScopedLatency latency(metrics::Stage::GrayConversion);
   cv::Mat gray_frame;
   cvtColor(data_, gray_frame, cv::COLOR_BGR2GRAY);
 
-  return Frame(std::move(gray_frame));
+  return Frame(std::move(gray_frame), stamp_, PixelFormat::Gray);
+}
+
+Frame Frame::toGray(FramePool& pool) const
+{
+  if (!valid())
+  {
+    return Frame();
+  }
+
+  if (format_ == PixelFormat::Gray)
+  {
+    return *this;
+  }
+
+  metrics::ScopedLatency latency(metrics::Stage::GrayConversion);
+  cv::Mat gray_frame = pool.acquire(data_.size(), CV_8UC1);
+  cvtColor(data_, gray_frame, cv::COLOR_BGR2GRAY);
+
+  return Frame(std::move(gray_frame), stamp_, PixelFormat::Gray);
 }
 
 Frame Frame::crop(unsigned int start_x, unsigned int start_y, unsigned int end_x, unsigned int end_y) const
@@ -36,5 +62,5 @@ Frame Frame::crop(unsigned int start_x, unsigned int start_y, unsigned int end_x
     return Frame();
   }
 
-  return Frame(data_(roi));
+  return Frame(data_(roi), stamp_, format_);
 }
\ No newline at end of file
@@ -0,0 +1,97 @@
+#include <motion_tracker/camera/frame_log.h>
+
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+FrameLogReader::FrameLogReader(const std::string& file_name)
+  : header_(nullptr)
+  , mapped_size_(0)
+{
+  int fd = open(file_name.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    printf("Failed to open frame log %s\n", file_name.c_str());
+    return;
+  }
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || static_cast<size_t>(file_stat.st_size) < FrameLogHeader::data_offset)
+  {
+    printf("Frame log %s is too short\n", file_name.c_str());
+    close(fd);
+    return;
+  }
+
+  void* mapping = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (mapping == MAP_FAILED)
+  {
+    printf("Failed to map frame log %s\n", file_name.c_str());
+    return;
+  }
+
+  const auto* header = static_cast<const FrameLogHeader*>(mapping);
+  if (std::memcmp(header->magic, FrameLogHeader::magic_value, sizeof(header->magic)) != 0 || header->version != FrameLogHeader::current_version)
+  {
+    printf("%s is not a frame log\n", file_name.c_str());
+    munmap(mapping, file_stat.st_size);
+    return;
+  }
+
+  // We only read sequentially, so let the kernel read ahead aggressively.
+  madvise(mapping, file_stat.st_size, MADV_SEQUENTIAL);
+
+  header_ = header;
+  mapped_size_ = file_stat.st_size;
+}
+
+FrameLogReader::~FrameLogReader()
+{
+  if (header_ != nullptr)
+  {
+    munmap(const_cast<FrameLogHeader*>(header_), mapped_size_);
+  }
+}
+
+size_t FrameLogReader::numFrames() const
+{
+  if (header_ == nullptr)
+  {
+    return 0;
+  }
+
+  // The file may have been truncated by an interrupted recording.
+  size_t stored_frames = (mapped_size_ - FrameLogHeader::data_offset) / header_->record_bytes;
+  return std::min<size_t>(__atomic_load_n(&header_->num_frames, __ATOMIC_ACQUIRE), stored_frames);
+}
+
+const uint8_t* FrameLogReader::record(size_t index) const
+{
+  return reinterpret_cast<const uint8_t*>(header_) + FrameLogHeader::data_offset + index * header_->record_bytes;
+}
+
+Frame::TimeStamp FrameLogReader::stamp(size_t index) const
+{
+  int64_t stamp_ns;
+  std::memcpy(&stamp_ns, record(index), sizeof(stamp_ns));
+
+  return Frame::TimeStamp(std::chrono::duration_cast<Frame::TimeStamp::duration>(std::chrono::nanoseconds(stamp_ns)));
+}
+
+bool FrameLogReader::read(size_t index, cv::Mat& dst) const
+{
+  if (index >= numFrames())
+  {
+    return false;
+  }
+
+  const uint8_t* data = record(index) + sizeof(int64_t);
+  cv::Mat(header_->height, header_->width, header_->type, const_cast<uint8_t*>(data)).copyTo(dst);
+
+  return true;
+}
@@ -0,0 +1,51 @@
+#include <motion_tracker/camera/frame_pool.h>
+
+static bool isReleased(const cv::Mat& buffer)
+{
+  // The pool holds one reference itself, so a count of one means that no Frame uses the buffer anymore.
+  return buffer.u != nullptr && CV_XADD(&buffer.u->refcount, 0) == 1;
+}
+
+FramePool::FramePool(size_t capacity)
+  : capacity_(capacity)
+  , misses_(0)
+{
+  buffers_.reserve(capacity_);
+}
+
+cv::Mat FramePool::acquire(const cv::Size& size, int type)
+{
+  std::lock_guard<std::mutex> _(lock_);
+
+  cv::Mat* reusable = nullptr;
+  for (auto& buffer : buffers_)
+  {
+    if (!isReleased(buffer))
+    {
+      continue;
+    }
+
+    if (buffer.size() == size && buffer.type() == type)
+    {
+      return buffer;
+    }
+    reusable = &buffer;
+  }
+
+  if (buffers_.size() < capacity_)
+  {
+    buffers_.emplace_back(size, type);
+    return buffers_.back();
+  }
+
+  if (reusable != nullptr)
+  {
+    // Only buffers of a different format are free, so replace one of them.
+    reusable->create(size, type);
+    return *reusable;
+  }
+
+  // Every pooled buffer is in use, fall back to a plain allocation rather than blocking the caller.
+  ++misses_;
+  return cv::Mat(size, type);
+}
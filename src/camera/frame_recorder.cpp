@@ -0,0 +1,185 @@
+#include <motion_tracker/camera/frame_recorder.h>
+#include <motion_tracker/camera/frame_log.h>
+#include <motion_tracker/camera/frame_ring.h>
+
+#include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+struct FrameRecorder::Internals
+{
+  Internals(const std::string& file_name, size_t max_frames, size_t queue_depth)
+    : file_name(file_name)
+    , max_frames(max_frames)
+    , queue(queue_depth, FrameRing::OverflowPolicy::DropOldest)
+  {}
+
+  bool open(const cv::Mat& first_frame);
+  bool write(const Frame& frame);
+  void close();
+
+  const std::string file_name;
+  const size_t max_frames;
+
+  FrameRing queue;
+  std::thread writer;
+
+  bool failed = false;
+  int fd = -1;
+  uint8_t* mapping = nullptr;
+  size_t mapped_size = 0;
+  FrameLogHeader* header = nullptr;
+
+  std::atomic<size_t> rejected{0};
+};
+
+bool FrameRecorder::Internals::open(const cv::Mat& first_frame)
+{
+  fd = ::open(file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    printf("Failed to create frame log %s\n", file_name.c_str());
+    return false;
+  }
+
+  size_t frame_bytes = first_frame.total() * first_frame.elemSize();
+  size_t record_bytes = (sizeof(int64_t) + frame_bytes + 7) & ~static_cast<size_t>(7);
+  mapped_size = FrameLogHeader::data_offset + max_frames * record_bytes;
+
+  // Reserve the disk space up front, so running out of it does not surface as a SIGBUS on the mapping.
+  if (posix_fallocate(fd, 0, mapped_size) != 0)
+  {
+    printf("Failed to preallocate %zu bytes for frame log %s\n", mapped_size, file_name.c_str());
+    ::close(fd);
+    fd = -1;
+    return false;
+  }
+
+  void* memory = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (memory == MAP_FAILED)
+  {
+    printf("Failed to map frame log %s\n", file_name.c_str());
+    ::close(fd);
+    fd = -1;
+    return false;
+  }
+
+  mapping = static_cast<uint8_t*>(memory);
+  header = reinterpret_cast<FrameLogHeader*>(mapping);
+
+  std::memcpy(header->magic, FrameLogHeader::magic_value, sizeof(header->magic));
+  header->version = FrameLogHeader::current_version;
+  header->width = first_frame.cols;
+  header->height = first_frame.rows;
+  header->type = first_frame.type();
+  header->frame_bytes = frame_bytes;
+  header->record_bytes = record_bytes;
+  header->capacity = max_frames;
+  header->num_frames = 0;
+
+  return true;
+}
+
+bool FrameRecorder::Internals::write(const Frame& frame)
+{
+  const cv::Mat& data = frame.data();
+
+  if (header == nullptr && (failed || !open(data)))
+  {
+    failed = true;
+    return false;
+  }
+
+  if (header->num_frames >= header->capacity ||
+      data.cols != header->width || data.rows != header->height || data.type() != header->type)
+  {
+    return false;
+  }
+
+  uint8_t* record = mapping + FrameLogHeader::data_offset + header->num_frames * header->record_bytes;
+
+  int64_t stamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(frame.stamp().time_since_epoch()).count();
+  std::memcpy(record, &stamp_ns, sizeof(stamp_ns));
+
+  uint8_t* pixels = record + sizeof(int64_t);
+  size_t row_bytes = data.cols * data.elemSize();
+  for (int row = 0; row < data.rows; ++row)
+  {
+    std::memcpy(pixels + row * row_bytes, data.ptr(row), row_bytes);
+  }
+
+  // Publishing the new count after the data makes the record visible to concurrent readers in one step.
+  __atomic_store_n(&header->num_frames, header->num_frames + 1, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+void FrameRecorder::Internals::close()
+{
+  if (mapping == nullptr)
+  {
+    return;
+  }
+
+  size_t used_size = FrameLogHeader::data_offset + header->num_frames * header->record_bytes;
+  munmap(mapping, mapped_size);
+
+  // Give back the preallocated space which was not used.
+  if (ftruncate(fd, used_size) != 0)
+  {
+    printf("Failed to trim frame log %s\n", file_name.c_str());
+  }
+  ::close(fd);
+
+  mapping = nullptr;
+  header = nullptr;
+}
+
+FrameRecorder::FrameRecorder(const std::string& file_name, size_t max_frames, size_t queue_depth)
+  : internals_(std::make_unique<Internals>(file_name, max_frames, queue_depth))
+  , recorded_(0)
+{
+  internals_->writer = std::thread([&]()
+    {
+      while (auto frame = internals_->queue.pop())
+      {
+        if (internals_->write(frame.value()))
+        {
+          ++recorded_;
+        }
+        else
+        {
+          ++internals_->rejected;
+        }
+      }
+      internals_->close();
+    });
+}
+
+FrameRecorder::~FrameRecorder()
+{
+  // Closing the queue lets the writer drain the frames already queued before it exits.
+  internals_->queue.close();
+  internals_->writer.join();
+
+  if (dropped() > 0)
+  {
+    printf("WARNING: Frame recorder dropped %zu frames, recorded %zu.\n", dropped(), recorded());
+  }
+}
+
+void FrameRecorder::record(const Frame& frame)
+{
+  if (!frame.valid())
+  {
+    return;
+  }
+  internals_->queue.push(frame);
+}
+
+size_t FrameRecorder::dropped() const
+{
+  return internals_->queue.dropped() + internals_->rejected.load();
+}
@@ -0,0 +1,105 @@
+#include <motion_tracker/camera/frame_ring.h>
+#include <algorithm>
+
+FrameRing::FrameRing(size_t capacity, OverflowPolicy policy)
+  : frames_(std::max<size_t>(capacity, 1))
+  , policy_(policy)
+  , head_(0)
+  , count_(0)
+  , dropped_(0)
+  , closed_(false)
+{
+}
+
+bool FrameRing::push(Frame frame)
+{
+  std::unique_lock<std::mutex> lock(lock_);
+
+  if (policy_ == OverflowPolicy::Block)
+  {
+    not_full_.wait(lock, [&]() { return closed_ || count_ < frames_.size(); });
+  }
+
+  if (closed_)
+  {
+    return false;
+  }
+
+  if (count_ == frames_.size())
+  {
+    head_ = (head_ + 1) % frames_.size();
+    --count_;
+    ++dropped_;
+  }
+
+  frames_[(head_ + count_) % frames_.size()] = std::move(frame);
+  ++count_;
+  lock.unlock();
+
+  not_empty_.notify_one();
+  return true;
+}
+
+std::optional<Frame> FrameRing::pop()
+{
+  std::unique_lock<std::mutex> lock(lock_);
+  not_empty_.wait(lock, [&]() { return closed_ || count_ > 0; });
+
+  if (count_ == 0)
+  {
+    return std::nullopt;
+  }
+
+  Frame frame = std::move(frames_[head_]);
+  frames_[head_] = Frame();
+  head_ = (head_ + 1) % frames_.size();
+  --count_;
+  lock.unlock();
+
+  not_full_.notify_one();
+  return std::optional<Frame>(std::move(frame));
+}
+
+std::optional<Frame> FrameRing::popLatest()
+{
+  std::unique_lock<std::mutex> lock(lock_);
+  if (count_ == 0)
+  {
+    return std::nullopt;
+  }
+
+  size_t newest = (head_ + count_ - 1) % frames_.size();
+  Frame frame = std::move(frames_[newest]);
+
+  for (; count_ > 0; --count_)
+  {
+    frames_[head_] = Frame();
+    head_ = (head_ + 1) % frames_.size();
+  }
+  lock.unlock();
+
+  not_full_.notify_all();
+  return std::optional<Frame>(std::move(frame));
+}
+
+void FrameRing::close()
+{
+  std::unique_lock<std::mutex> lock(lock_);
+  closed_ = true;
+  lock.unlock();
+
+  not_empty_.notify_all();
+  not_full_.notify_all();
+}
+
+size_t FrameRing::size() const
+{
+  std::lock_guard<std::mutex> _(lock_);
+  return count_;
+}
+
+size_t FrameRing::dropped() const
+{
+  std::lock_guard<std::mutex> _(lock_);
+  return dropped_;
+}
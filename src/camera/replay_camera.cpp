@@ -0,0 +1,225 @@
+#include <motion_tracker/camera/replay_camera.h>
+#include <motion_tracker/camera/frame_ring.h>
+#include <motion_tracker/camera/frame_log.h>
+#include <motion_tracker/metrics.h>
+#include <motion_tracker/tracing.h>
+
+#include <opencv2/imgcodecs.hpp>
+
+#include <atomic>
+#include <thread>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+
+struct RecordedFrame
+{
+  std::string file_name;
+  Frame::TimeStamp stamp;
+};
+
+static bool isRegularFile(const std::string& path)
+{
+  struct stat buffer;
+  return (stat(path.c_str(), &buffer) == 0) && S_ISREG(buffer.st_mode);
+}
+
+static std::vector<RecordedFrame> readRecording(const std::string& path, double frame_rate, const FrameLogReader* log)
+{
+  std::vector<RecordedFrame> frames;
+
+  if (log != nullptr)
+  {
+    frames.reserve(log->numFrames());
+    for (size_t index = 0; index < log->numFrames(); ++index)
+    {
+      frames.push_back({path, log->stamp(index)});
+    }
+    return frames;
+  }
+
+  std::ifstream index_file(path + "/timestamps.txt");
+  if (index_file.is_open())
+  {
+    std::string line;
+    while (std::getline(index_file, line))
+    {
+      std::istringstream fields(line);
+
+      long long stamp_us;
+      std::string file_name;
+      if (fields >> stamp_us >> file_name)
+      {
+        frames.push_back({path + "/" + file_name, Frame::TimeStamp(std::chrono::microseconds(stamp_us))});
+      }
+    }
+    return frames;
+  }
+
+  std::vector<cv::String> file_names;
+  cv::glob(path, file_names, false);
+
+  auto frame_period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / frame_rate));
+  for (const auto& file_name : file_names)
+  {
+    if (cv::haveImageReader(file_name))
+    {
+      frames.push_back({file_name, Frame::TimeStamp(frame_period * static_cast<int64_t>(frames.size()))});
+    }
+  }
+  return frames;
+}
+
+struct ReplayCamera::Internals
+{
+  Internals(const std::string& path, double frame_rate, Mode mode)
+    : log(isRegularFile(path) ? std::make_unique<FrameLogReader>(path) : nullptr)
+    , frames(readRecording(path, frame_rate, log.get()))
+    , mode(mode)
+    , pool(frame_pool_size)
+    , ring(prefetch_depth, FrameRing::OverflowPolicy::Block)
+  {}
+
+  static constexpr size_t frame_pool_size = 16;
+  static constexpr size_t prefetch_depth = 8;
+
+  std::optional<Frame> load(size_t index)
+  {
+    metrics::ScopedLatency latency(metrics::Stage::Grab);
+    tracing::Span span("ReplayCamera::load");
+    if (log)
+    {
+      cv::Mat image = frame_size.empty() ? cv::Mat() : pool.acquire(frame_size, frame_type);
+      if (!log->read(index, image))
+      {
+        return std::nullopt;
+      }
+
+      frame_size = image.size();
+      frame_type = image.type();
+
+      return std::optional<Frame>(Frame(std::move(image), frames[index].stamp));
+    }
+
+    std::ifstream file(frames[index].file_name, std::ios::binary);
+    if (!file.is_open())
+    {
+      return std::nullopt;
+    }
+
+    file.seekg(0, std::ios::end);
+    file_buffer.resize(file.tellg());
+    file.seekg(0, std::ios::beg);
+    file.read(reinterpret_cast<char*>(file_buffer.data()), file_buffer.size());
+
+    // Decoding into a pooled buffer of the previous frame's format avoids reallocating it.
+    cv::Mat image = frame_size.empty() ? cv::Mat() : pool.acquire(frame_size, frame_type);
+    cv::imdecode(file_buffer, cv::IMREAD_UNCHANGED, &image);
+    if (image.empty())
+    {
+      return std::nullopt;
+    }
+
+    frame_size = image.size();
+    frame_type = image.type();
+
+    return std::optional<Frame>(Frame(std::move(image), frames[index].stamp));
+  }
+
+  const std::unique_ptr<FrameLogReader> log;
+  const std::vector<RecordedFrame> frames;
+  const Mode mode;
+
+  FramePool pool;
+  FrameRing ring;
+
+  std::thread prefetcher;
+  std::atomic_bool running{false};
+
+  std::vector<uchar> file_buffer;
+  cv::Size frame_size;
+  int frame_type = CV_8UC3;
+
+  std::optional<std::chrono::steady_clock::time_point> replay_start;
+};
+
+ReplayCamera::ReplayCamera(CameraConfig config, const std::string& path, Mode mode, double frame_rate)
+  : config_(config)
+  , internals_(std::make_unique<Internals>(path, frame_rate, mode))
+{
+  if (internals_->frames.empty())
+  {
+    printf("WARNING: No frames found in the recording at %s!\n", path.c_str());
+  }
+
+  std::optional<Frame> first_frame;
+  if (!internals_->frames.empty())
+  {
+    first_frame = internals_->load(0);
+  }
+
+  if (first_frame.has_value())
+  {
+    // The recording holds frames which are already corrected, so they define the image size.
+    const auto& size = first_frame->data().size();
+    config_ = CameraConfig(config.v_fov, config.h_fov, size.width, size.height, config.camera_roll, config.camera_pitch, config.ground_height);
+    internals_->ring.push(std::move(first_frame.value()));
+  }
+
+  internals_->running = true;
+  internals_->prefetcher = std::thread([&]()
+    {
+      for (size_t index = 1; index < internals_->frames.size() && internals_->running; ++index)
+      {
+        auto frame = internals_->load(index);
+        if (!frame.has_value())
+        {
+          printf("WARNING: Failed to load %s, skipping it.\n", internals_->frames[index].file_name.c_str());
+          continue;
+        }
+
+        if (!internals_->ring.push(std::move(frame.value())))
+        {
+          break;
+        }
+      }
+      internals_->ring.close();
+    });
+}
+
+ReplayCamera::~ReplayCamera()
+{
+  internals_->running = false;
+  internals_->ring.close();
+  internals_->prefetcher.join();
+}
+
+std::optional<Frame> ReplayCamera::grab()
+{
+  tracing::Span span("ReplayCamera::grab");
+  auto frame = internals_->ring.pop();
+  if (!frame.has_value() || internals_->mode == Mode::MaxSpeed)
+  {
+    return frame;
+  }
+
+  // Hold the frame back until the same time has passed since the start of the replay as in the recording.
+  auto now = std::chrono::steady_clock::now();
+  if (!internals_->replay_start)
+  {
+    internals_->replay_start = now - (frame->stamp() - internals_->frames.front().stamp);
+  }
+
+  std::this_thread::sleep_until(internals_->replay_start.value() + (frame->stamp() - internals_->frames.front().stamp));
+  return frame;
+}
+
+FramePool& ReplayCamera::pool()
+{
+  return internals_->pool;
+}
+
+size_t ReplayCamera::numFrames() const
+{
+  return internals_->frames.size();
+}
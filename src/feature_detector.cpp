@@ -0,0 +1,89 @@
+#include <motion_tracker/feature_detector.h>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/features2d.hpp>
+#include <algorithm>
+
+class ShiTomasiDetector : public FeatureDetector
+{
+public:
+  void detect(const cv::Mat& image, size_t max_corners, float min_distance, std::vector<cv::Point2f>& corners, const cv::Mat& mask) override
+  {
+    goodFeaturesToTrack(image, corners, max_corners, 0.00001, min_distance, mask);
+  }
+
+  const char* name() const override { return "shi-tomasi"; }
+};
+
+// Segment test detectors: cheap to evaluate, but they report every corner above the threshold, so
+//  the strongest responses are picked and spaced out here.
+class SegmentTestDetector : public FeatureDetector
+{
+public:
+  explicit SegmentTestDetector(FeatureDetector::Type type): type_(type) {}
+
+  void detect(const cv::Mat& image, size_t max_corners, float min_distance, std::vector<cv::Point2f>& corners, const cv::Mat& mask) override
+  {
+    corners.clear();
+
+    if (type_ == FeatureDetector::Type::Agast)
+    {
+      cv::AGAST(image, keypoints_, threshold, true);
+    }
+    else
+    {
+      cv::FAST(image, keypoints_, threshold, true);
+    }
+
+    if (!mask.empty())
+    {
+      keypoints_.erase(std::remove_if(keypoints_.begin(), keypoints_.end(), [&](const cv::KeyPoint& keypoint)
+      {
+        return mask.at<uchar>(cvRound(keypoint.pt.y), cvRound(keypoint.pt.x)) == 0;
+      }), keypoints_.end());
+    }
+
+    std::sort(keypoints_.begin(), keypoints_.end(), [](const cv::KeyPoint& a, const cv::KeyPoint& b) { return a.response > b.response; });
+
+    // Only a few corners are requested per tile, so a linear scan over the accepted ones is cheapest
+    const float min_distance_sq = min_distance * min_distance;
+    for (const auto& keypoint : keypoints_)
+    {
+      if (corners.size() >= max_corners)
+      {
+        break;
+      }
+
+      bool isolated = std::none_of(corners.begin(), corners.end(), [&](const cv::Point2f& pt)
+      {
+        cv::Point2f d = pt - keypoint.pt;
+        return d.dot(d) < min_distance_sq;
+      });
+
+      if (isolated)
+      {
+        corners.push_back(keypoint.pt);
+      }
+    }
+  }
+
+  const char* name() const override { return type_ == FeatureDetector::Type::Agast ? "agast" : "fast"; }
+
+private:
+  static constexpr int threshold = 15;
+
+  const FeatureDetector::Type type_;
+  std::vector<cv::KeyPoint> keypoints_;
+};
+
+std::unique_ptr<FeatureDetector> createFeatureDetector(FeatureDetector::Type type)
+{
+  switch (type)
+  {
+    case FeatureDetector::Type::Fast:
+    case FeatureDetector::Type::Agast:
+      return std::make_unique<SegmentTestDetector>(type);
+    case FeatureDetector::Type::ShiTomasi:
+    default:
+      return std::make_unique<ShiTomasiDetector>();
+  }
+}
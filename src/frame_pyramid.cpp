@@ -0,0 +1,72 @@
+#include <motion_tracker/frame_pyramid.h>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/video/tracking.hpp>
+#include <algorithm>
+
+FramePyramid::FramePyramid(cv::Size window_size, int max_level, double scale, int refine_window)
+  : window_size_(window_size)
+  , max_level_(max_level)
+  , scale_(std::min(scale, 1.0))
+  , refine_window_(refine_window)
+{
+}
+
+void FramePyramid::build(const Frame& gray_frame)
+{
+  if (scale_ >= 1.0 || !gray_frame.valid())
+  {
+    frame_ = gray_frame;
+    cv::buildOpticalFlowPyramid(frame_.data(), levels_, window_size_, max_level_, true);
+    return;
+  }
+
+  // The pyramid is only rebuilt once no tracker refers to it, so the downscaled image can be overwritten
+  cv::resize(gray_frame.data(), scaled_image_, cv::Size(), scale_, scale_, cv::INTER_AREA);
+  frame_ = Frame(scaled_image_, gray_frame.stamp(), Frame::PixelFormat::Gray);
+  cv::buildOpticalFlowPyramid(frame_.data(), levels_, window_size_, max_level_, true);
+
+  if (refine_window_ > 0)
+  {
+    full_frame_ = gray_frame;
+    cv::buildOpticalFlowPyramid(full_frame_.data(), full_levels_, cv::Size(refine_window_, refine_window_), 0, true);
+  }
+}
+
+PyramidCache::PyramidCache(cv::Size window_size, int max_level, size_t capacity, double scale, int refine_window)
+  : window_size_(window_size)
+  , max_level_(max_level)
+  , capacity_(capacity)
+  , scale_(scale)
+  , refine_window_(refine_window)
+{
+  pyramids_.reserve(capacity_);
+}
+
+std::shared_ptr<const FramePyramid> PyramidCache::build(const Frame& gray_frame)
+{
+  std::shared_ptr<FramePyramid> pyramid;
+  {
+    std::lock_guard<std::mutex> _(lock_);
+    for (const auto& cached : pyramids_)
+    {
+      // Only referenced by the cache, so no tracker uses it anymore
+      if (cached.use_count() == 1)
+      {
+        pyramid = cached;
+        break;
+      }
+    }
+
+    if (!pyramid)
+    {
+      pyramid = std::make_shared<FramePyramid>(window_size_, max_level_, scale_, refine_window_);
+      if (pyramids_.size() < capacity_)
+      {
+        pyramids_.push_back(pyramid);
+      }
+    }
+  }
+
+  pyramid->build(gray_frame);
+  return pyramid;
+}
@@ -0,0 +1,56 @@
+#include <motion_tracker/ground_projection.h>
+#include <cmath>
+#include <memory>
+
+static double elevationOf(double y, double img_height, double focal_length)
+{
+  return atan2(2.0 * y - img_height, focal_length);
+}
+
+GroundProjection::GroundProjection(const CameraConfig& config)
+  : img_width_(config.img_width)
+  , img_height_(config.img_height)
+  , focal_length_(config.focal_length)
+  , camera_pitch_(config.camera_pitch)
+  , ground_height_(config.ground_height)
+  , last_row_(static_cast<double>(config.img_height) * subsamples)
+{
+  size_t num_rows = config.img_height * subsamples + 1;
+  inv_depth_.resize(num_rows);
+  forward_ratio_.resize(num_rows);
+
+  // Both are linear in the tangent of the elevation, and so in the image row, which keeps the
+  //  interpolation exact right up to the horizon, where the depth's reciprocal crosses zero.
+  for (size_t row = 0; row < num_rows; ++row)
+  {
+    double elevation = elevationOf(static_cast<double>(row) / subsamples, img_height_, focal_length_);
+
+    inv_depth_[row] = sin(elevation + camera_pitch_) / (ground_height_ * cos(elevation));
+    forward_ratio_[row] = cos(elevation + camera_pitch_) / cos(elevation);
+  }
+}
+
+bool GroundProjection::matches(const CameraConfig& config) const
+{
+  return img_width_ == config.img_width && img_height_ == config.img_height && focal_length_ == config.focal_length &&
+    camera_pitch_ == config.camera_pitch && ground_height_ == config.ground_height;
+}
+
+void GroundProjection::projectDirect(double x, double y, double& ground_x, double& ground_y) const
+{
+  double elevation = elevationOf(y, img_height_, focal_length_);
+  double depth = ground_height_ * cos(elevation) / sin(elevation + camera_pitch_);
+
+  ground_x = depth * (2.0 * x - img_width_) / focal_length_;
+  ground_y = ground_height_ / tan(elevation + camera_pitch_);
+}
+
+const GroundProjection& groundProjection(const CameraConfig& config)
+{
+  thread_local std::unique_ptr<GroundProjection> projection;
+  if (!projection || !projection->matches(config))
+  {
+    projection = std::make_unique<GroundProjection>(config);
+  }
+  return *projection;
+}
@@ -0,0 +1,532 @@
+#include <motion_tracker/lk_engine.h>
+#include <motion_tracker/simd.h>
+#include <motion_tracker/tracing.h>
+
+#include <opencv2/video/tracking.hpp>
+
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+// The specialized kernels follow the fixed-point scheme of cv::calcOpticalFlowPyrLK: bilinear
+//  weights with W_BITS of precision, image patches scaled by 2^5, and gradient sums scaled back by
+//  2^-20, so that the results agree with the OpenCV implementation up to rounding.
+static constexpr int W_BITS = 14;
+static constexpr float FLT_SCALE = 1.f / (1 << 20);
+static constexpr float min_eigen_threshold = 1e-4f;
+
+// One level of a pyramid built by cv::buildOpticalFlowPyramid. Both images are surrounded by
+//  <border> pixels of padding, which keeps every read of a window that passes the bounds checks
+//  inside the buffer.
+struct LevelView
+{
+  const uint8_t* image;
+  size_t image_step;    // [bytes]
+  const int16_t* deriv; // Interleaved (dx, dy) Scharr derivatives
+  size_t deriv_step;    // [elements]
+  int cols;
+  int rows;
+  int border;
+};
+
+struct BilinearWeights
+{
+  BilinearWeights(float a, float b)
+    : w00(static_cast<int>(std::lrint((1.f - a) * (1.f - b) * (1 << W_BITS))))
+    , w01(static_cast<int>(std::lrint(a * (1.f - b) * (1 << W_BITS))))
+    , w10(static_cast<int>(std::lrint((1.f - a) * b * (1 << W_BITS))))
+    , w11((1 << W_BITS) - w00 - w01 - w10)
+  {}
+
+  const int w00;
+  const int w01;
+  const int w10;
+  const int w11;
+};
+
+template<int Window>
+struct Patch
+{
+  // Rows are padded to a multiple of the widest vector; the padding columns of the derivatives are
+  //  zero, so they do not contribute to any of the sums.
+  static constexpr int stride = (Window + 15) / 16 * 16;
+
+  alignas(32) int16_t image[Window * stride];
+  alignas(32) int16_t dx[Window * stride];
+  alignas(32) int16_t dy[Window * stride];
+};
+
+// Bilinear interpolation of Ops::lanes pixels of an 8 bit image, scaled by 2^5.
+template<class Ops>
+static inline typename Ops::i16 interpolate(const uint8_t* src, size_t step, typename Ops::i16 w_top, typename Ops::i16 w_bottom)
+{
+  auto top0 = Ops::load_u8(src);
+  auto top1 = Ops::load_u8(src + 1);
+  auto bottom0 = Ops::load_u8(src + step);
+  auto bottom1 = Ops::load_u8(src + step + 1);
+
+  auto lo = Ops::add(Ops::madd(Ops::zip_lo(top0, top1), w_top), Ops::madd(Ops::zip_lo(bottom0, bottom1), w_bottom));
+  auto hi = Ops::add(Ops::madd(Ops::zip_hi(top0, top1), w_top), Ops::madd(Ops::zip_hi(bottom0, bottom1), w_bottom));
+
+  return Ops::pack_zipped(Ops::template descale<W_BITS - 5>(lo), Ops::template descale<W_BITS - 5>(hi));
+}
+
+// Bilinear interpolation of Ops::lanes / 2 pixels of the interleaved derivatives, split into their x and y parts.
+template<class Ops>
+static inline void interpolateDeriv(const int16_t* src, size_t step, typename Ops::i16 w_top, typename Ops::i16 w_bottom,
+  typename Ops::i32& dx, typename Ops::i32& dy)
+{
+  auto top0 = Ops::load(src);
+  auto top1 = Ops::load(src + 2);
+  auto bottom0 = Ops::load(src + step);
+  auto bottom1 = Ops::load(src + step + 2);
+
+  auto lo = Ops::add(Ops::madd(Ops::zip_lo(top0, top1), w_top), Ops::madd(Ops::zip_lo(bottom0, bottom1), w_bottom));
+  auto hi = Ops::add(Ops::madd(Ops::zip_hi(top0, top1), w_top), Ops::madd(Ops::zip_hi(bottom0, bottom1), w_bottom));
+
+  auto dxy = Ops::as_i32(Ops::pack_zipped(Ops::template descale<W_BITS>(lo), Ops::template descale<W_BITS>(hi)));
+  dx = Ops::low16(dxy);
+  dy = Ops::high16(dxy);
+}
+
+template<class Ops, int Window>
+static void extractPatch(const LevelView& level, int x0, int y0, const BilinearWeights& w, Patch<Window>& patch)
+{
+  constexpr int stride = Patch<Window>::stride;
+
+  auto w_top = Ops::set_pair(w.w00, w.w01);
+  auto w_bottom = Ops::set_pair(w.w10, w.w11);
+
+  for (int y = 0; y < Window; ++y)
+  {
+    const uint8_t* src = level.image + (y0 + y) * level.image_step + x0;
+    const int16_t* dsrc = level.deriv + (y0 + y) * level.deriv_step + 2 * x0;
+
+    int16_t* image_row = patch.image + y * stride;
+    int16_t* dx_row = patch.dx + y * stride;
+    int16_t* dy_row = patch.dy + y * stride;
+
+    for (int x = 0; x < stride; x += Ops::lanes)
+    {
+      Ops::store(image_row + x, interpolate<Ops>(src + x, level.image_step, w_top, w_bottom));
+
+      typename Ops::i32 dx_lo, dy_lo, dx_hi, dy_hi;
+      interpolateDeriv<Ops>(dsrc + 2 * x, level.deriv_step, w_top, w_bottom, dx_lo, dy_lo);
+      interpolateDeriv<Ops>(dsrc + 2 * x + Ops::lanes, level.deriv_step, w_top, w_bottom, dx_hi, dy_hi);
+
+      Ops::store(dx_row + x, Ops::pack(dx_lo, dx_hi));
+      Ops::store(dy_row + x, Ops::pack(dy_lo, dy_hi));
+    }
+
+    std::fill(dx_row + Window, dx_row + stride, 0);
+    std::fill(dy_row + Window, dy_row + stride, 0);
+  }
+}
+
+// Spatial gradient matrix of the patch: [A11 A12; A12 A22]
+template<class Ops, int Window>
+static void gradientMatrix(const Patch<Window>& patch, float& A11, float& A12, float& A22)
+{
+  auto a11 = Ops::zero();
+  auto a12 = Ops::zero();
+  auto a22 = Ops::zero();
+
+  for (int i = 0; i < Window * Patch<Window>::stride; i += Ops::lanes)
+  {
+    auto dx = Ops::load(patch.dx + i);
+    auto dy = Ops::load(patch.dy + i);
+
+    a11 = Ops::accumulate(a11, Ops::madd(dx, dx));
+    a12 = Ops::accumulate(a12, Ops::madd(dx, dy));
+    a22 = Ops::accumulate(a22, Ops::madd(dy, dy));
+  }
+
+  A11 = Ops::sum(a11) * FLT_SCALE;
+  A12 = Ops::sum(a12) * FLT_SCALE;
+  A22 = Ops::sum(a22) * FLT_SCALE;
+}
+
+// Image mismatch vector between the patch and the next image at (x0, y0): [b1 b2]
+template<class Ops, int Window>
+static void mismatchVector(const LevelView& level, int x0, int y0, const BilinearWeights& w, const Patch<Window>& patch, float& b1, float& b2)
+{
+  constexpr int stride = Patch<Window>::stride;
+
+  auto w_top = Ops::set_pair(w.w00, w.w01);
+  auto w_bottom = Ops::set_pair(w.w10, w.w11);
+
+  auto sum1 = Ops::zero();
+  auto sum2 = Ops::zero();
+
+  for (int y = 0; y < Window; ++y)
+  {
+    const uint8_t* src = level.image + (y0 + y) * level.image_step + x0;
+
+    for (int x = 0; x < stride; x += Ops::lanes)
+    {
+      int i = y * stride + x;
+      auto diff = Ops::subs(interpolate<Ops>(src + x, level.image_step, w_top, w_bottom), Ops::load(patch.image + i));
+
+      sum1 = Ops::accumulate(sum1, Ops::madd(diff, Ops::load(patch.dx + i)));
+      sum2 = Ops::accumulate(sum2, Ops::madd(diff, Ops::load(patch.dy + i)));
+    }
+  }
+
+  b1 = Ops::sum(sum1) * FLT_SCALE;
+  b2 = Ops::sum(sum2) * FLT_SCALE;
+}
+
+// Besides the checks of OpenCV, the window must not touch the last row of the padded buffer, as the
+//  vector loads read a few elements past the end of the window's rows.
+template<int Window>
+static bool windowInside(const LevelView& level, int x0, int y0)
+{
+  return x0 >= -Window && y0 >= -Window && x0 < level.cols && y0 < level.rows
+    && x0 >= -level.border && y0 >= -level.border && y0 + Window + 1 < level.rows + level.border;
+}
+
+template<class Ops, int Window, int Levels>
+static bool trackPoint(const LevelView* prev_levels, const LevelView* next_levels, float prev_x, float prev_y, float& next_x, float& next_y,
+  int max_iterations, float epsilon_sq, Patch<Window>& patch)
+{
+  constexpr float half_window = (Window - 1) * 0.5f;
+  bool status = true;
+
+  for (int level = Levels; level >= 0; --level)
+  {
+    const LevelView& I = prev_levels[level];
+    const LevelView& J = next_levels[level];
+
+    float scale = 1.f / (1 << level);
+    float px = prev_x * scale;
+    float py = prev_y * scale;
+
+    if (level == Levels)
+    {
+      next_x = px;
+      next_y = py;
+    }
+    else
+    {
+      next_x *= 2.f;
+      next_y *= 2.f;
+    }
+
+    px -= half_window;
+    py -= half_window;
+
+    int ipx = static_cast<int>(std::floor(px));
+    int ipy = static_cast<int>(std::floor(py));
+
+    if (!windowInside<Window>(I, ipx, ipy))
+    {
+      if (level == 0)
+      {
+        status = false;
+      }
+      continue;
+    }
+
+    extractPatch<Ops, Window>(I, ipx, ipy, BilinearWeights(px - ipx, py - ipy), patch);
+
+    float A11, A12, A22;
+    gradientMatrix<Ops, Window>(patch, A11, A12, A22);
+
+    float D = A11 * A22 - A12 * A12;
+    float min_eigen = (A22 + A11 - std::sqrt((A11 - A22) * (A11 - A22) + 4.f * A12 * A12)) / (2 * Window * Window);
+
+    if (min_eigen < min_eigen_threshold || D < FLT_EPSILON)
+    {
+      if (level == 0)
+      {
+        status = false;
+      }
+      continue;
+    }
+
+    D = 1.f / D;
+
+    float nx = next_x - half_window;
+    float ny = next_y - half_window;
+    float prev_delta_x = 0;
+    float prev_delta_y = 0;
+
+    for (int iteration = 0; iteration < max_iterations; ++iteration)
+    {
+      int inx = static_cast<int>(std::floor(nx));
+      int iny = static_cast<int>(std::floor(ny));
+
+      if (!windowInside<Window>(J, inx, iny))
+      {
+        if (level == 0)
+        {
+          status = false;
+        }
+        break;
+      }
+
+      float b1, b2;
+      mismatchVector<Ops, Window>(J, inx, iny, BilinearWeights(nx - inx, ny - iny), patch, b1, b2);
+
+      float delta_x = (A12 * b2 - A22 * b1) * D;
+      float delta_y = (A12 * b1 - A11 * b2) * D;
+
+      nx += delta_x;
+      ny += delta_y;
+      next_x = nx + half_window;
+      next_y = ny + half_window;
+
+      if (delta_x * delta_x + delta_y * delta_y <= epsilon_sq)
+      {
+        break;
+      }
+
+      // Oscillating between two positions, settle in the middle
+      if (iteration > 0 && std::abs(delta_x + prev_delta_x) < 0.01f && std::abs(delta_y + prev_delta_y) < 0.01f)
+      {
+        next_x -= delta_x * 0.5f;
+        next_y -= delta_y * 0.5f;
+        break;
+      }
+
+      prev_delta_x = delta_x;
+      prev_delta_y = delta_y;
+    }
+  }
+
+  return status;
+}
+
+template<class Ops, int Window, int Levels>
+static void trackPointsKernel(const LevelView* prev_levels, const LevelView* next_levels, const cv::Point2f* prev_points, cv::Point2f* next_points,
+  uchar* status, size_t count, int max_iterations, float epsilon_sq)
+{
+  Patch<Window> patch;
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    float next_x, next_y;
+    status[i] = trackPoint<Ops, Window, Levels>(prev_levels, next_levels, prev_points[i].x, prev_points[i].y, next_x, next_y,
+      max_iterations, epsilon_sq, patch) ? 1 : 0;
+    next_points[i] = cv::Point2f(next_x, next_y);
+  }
+}
+
+using KernelFunction = void (*)(const LevelView*, const LevelView*, const cv::Point2f*, cv::Point2f*, uchar*, size_t, int, float);
+
+struct Specialization
+{
+  int window_size;
+  int max_level;
+  KernelFunction kernel;
+};
+
+// The configurations the kernels are compiled for; anything else is handled by OpenCV.
+static const Specialization specializations[] = {
+  {30, 1, &trackPointsKernel<simd::NativeOps, 30, 1>},
+  {21, 1, &trackPointsKernel<simd::NativeOps, 21, 1>},
+  {15, 1, &trackPointsKernel<simd::NativeOps, 15, 1>},
+  {30, 2, &trackPointsKernel<simd::NativeOps, 30, 2>},
+  {21, 2, &trackPointsKernel<simd::NativeOps, 21, 2>},
+  {15, 2, &trackPointsKernel<simd::NativeOps, 15, 2>},
+};
+
+static KernelFunction findKernel(cv::Size window_size, int max_level)
+{
+  if (window_size.width != window_size.height)
+  {
+    return nullptr;
+  }
+
+  for (const auto& specialization : specializations)
+  {
+    if (specialization.window_size == window_size.width && specialization.max_level == max_level)
+    {
+      return specialization.kernel;
+    }
+  }
+  return nullptr;
+}
+
+static int paddingOf(const cv::Mat& level)
+{
+  cv::Size whole_size;
+  cv::Point offset;
+  level.locateROI(whole_size, offset);
+
+  return std::min({offset.x, offset.y, whole_size.width - offset.x - level.cols, whole_size.height - offset.y - level.rows});
+}
+
+// Returns false if the pyramid lacks the levels, the derivatives or the padding the kernels rely on.
+static bool getLevels(const FramePyramid& pyramid, int max_level, int window_size, std::vector<LevelView>& views)
+{
+  const auto& levels = pyramid.levels();
+  if (static_cast<int>(levels.size()) < 2 * (max_level + 1))
+  {
+    return false;
+  }
+
+  views.clear();
+  for (int level = 0; level <= max_level; ++level)
+  {
+    const cv::Mat& image = levels[2 * level];
+    const cv::Mat& deriv = levels[2 * level + 1];
+
+    if (image.type() != CV_8UC1 || deriv.type() != CV_16SC2 || image.size() != deriv.size())
+    {
+      return false;
+    }
+
+    int border = std::min(paddingOf(image), paddingOf(deriv));
+    if (border < window_size)
+    {
+      return false;
+    }
+
+    views.push_back({image.ptr<uint8_t>(), image.step[0], deriv.ptr<int16_t>(), deriv.step[0] / sizeof(int16_t), image.cols, image.rows, border});
+  }
+  return true;
+}
+
+bool hasSpecializedKernel(cv::Size window_size, int max_level)
+{
+  return findKernel(window_size, max_level) != nullptr;
+}
+
+const char* specializedKernelInstructionSet()
+{
+  return simd::NativeOps::name;
+}
+
+// Tracks the <count> points at <prev_points>, writing the results to <next_points> and <status>.
+static void trackRange(LkEngine engine, const FramePyramid& prev, const FramePyramid& next,
+  const cv::Point2f* prev_points, cv::Point2f* next_points, uchar* status, size_t count,
+  cv::Size window_size, int max_level, const cv::TermCriteria& criteria)
+{
+  if (engine == LkEngine::Specialized)
+  {
+    // The pyramids may have been built deeper than what is used here
+    int used_level = std::min({max_level, prev.maxLevel(), next.maxLevel()});
+    KernelFunction kernel = findKernel(window_size, used_level);
+
+    thread_local std::vector<LevelView> prev_levels;
+    thread_local std::vector<LevelView> next_levels;
+
+    if (kernel != nullptr &&
+        getLevels(prev, used_level, window_size.width, prev_levels) &&
+        getLevels(next, used_level, window_size.width, next_levels))
+    {
+      int max_iterations = (criteria.type & cv::TermCriteria::COUNT) ? std::max(criteria.maxCount, 0) : 30;
+      double epsilon = (criteria.type & cv::TermCriteria::EPS) ? std::max(criteria.epsilon, 0.0) : 0.01;
+
+      kernel(prev_levels.data(), next_levels.data(), prev_points, next_points, status, count,
+        max_iterations, static_cast<float>(epsilon * epsilon));
+      return;
+    }
+  }
+
+  // Headers over the caller's buffers, which OpenCV fills in place as they have the expected size
+  cv::Mat prev_mat(static_cast<int>(count), 1, CV_32FC2, const_cast<cv::Point2f*>(prev_points));
+  cv::Mat next_mat(static_cast<int>(count), 1, CV_32FC2, next_points);
+  cv::Mat status_mat(static_cast<int>(count), 1, CV_8UC1, status);
+  cv::calcOpticalFlowPyrLK(prev.levels(), next.levels(), prev_mat, next_mat, status_mat, cv::noArray(), window_size, max_level, criteria);
+}
+
+void trackPoints(LkEngine engine, const FramePyramid& prev, const FramePyramid& next,
+  const std::vector<cv::Point2f>& prev_points, std::vector<cv::Point2f>& next_points, std::vector<uchar>& status,
+  cv::Size window_size, int max_level, const cv::TermCriteria& criteria)
+{
+  next_points.resize(prev_points.size());
+  status.resize(prev_points.size());
+
+  if (prev_points.empty())
+  {
+    return;
+  }
+
+  trackRange(engine, prev, next, prev_points.data(), next_points.data(), status.data(), prev_points.size(), window_size, max_level, criteria);
+}
+
+// Chunks are handed out in order through a shared counter: every participating thread keeps
+//  claiming the next unprocessed chunk until none are left, so threads which got through their
+//  chunks quickly take over the work the slower ones have not started on.
+struct ChunkSchedule
+{
+  ChunkSchedule(size_t num_chunks): num_chunks(num_chunks) {}
+
+  template<class Work>
+  void run(const Work& work)
+  {
+    size_t processed = 0;
+    for (size_t chunk = next_chunk++; chunk < num_chunks; chunk = next_chunk++)
+    {
+      work(chunk);
+      ++processed;
+    }
+
+    if (processed > 0 && (finished_chunks += processed) == num_chunks)
+    {
+      std::lock_guard<std::mutex> _(lock);
+      done.notify_all();
+    }
+  }
+
+  void wait()
+  {
+    std::unique_lock<std::mutex> lock_handle(lock);
+    done.wait(lock_handle, [this]() { return finished_chunks == num_chunks; });
+  }
+
+  const size_t num_chunks;
+  std::atomic<size_t> next_chunk{0};
+  std::atomic<size_t> finished_chunks{0};
+
+  std::mutex lock;
+  std::condition_variable done;
+};
+
+void trackPoints(LkEngine engine, const FramePyramid& prev, const FramePyramid& next,
+  const std::vector<cv::Point2f>& prev_points, std::vector<cv::Point2f>& next_points, std::vector<uchar>& status,
+  cv::Size window_size, int max_level, const cv::TermCriteria& criteria,
+  ThreadPool& workers, size_t chunk_size)
+{
+  chunk_size = std::max<size_t>(chunk_size, 1);
+  const size_t num_chunks = (prev_points.size() + chunk_size - 1) / chunk_size;
+
+  if (num_chunks <= 1)
+  {
+    trackPoints(engine, prev, next, prev_points, next_points, status, window_size, max_level, criteria);
+    return;
+  }
+
+  // Every chunk writes its own range of the results, so they end up in the order of the input
+  next_points.resize(prev_points.size());
+  status.resize(prev_points.size());
+
+  auto track_chunk = [&, chunk_size](size_t chunk)
+  {
+    tracing::Span span("trackPoints chunk");
+    size_t begin = chunk * chunk_size;
+    size_t count = std::min(chunk_size, prev_points.size() - begin);
+    trackRange(engine, prev, next, prev_points.data() + begin, next_points.data() + begin, status.data() + begin, count,
+      window_size, max_level, criteria);
+  };
+
+  // The helpers may only get to run once all the chunks are done, so the schedule outlives this call;
+  //  a helper which finds no chunk left returns without touching anything else.
+  auto schedule = std::make_shared<ChunkSchedule>(num_chunks);
+  for (size_t helper = 1; helper < num_chunks; ++helper)
+  {
+    workers.addWork([schedule, track_chunk]()
+    {
+      schedule->run(track_chunk);
+    });
+  }
+
+  // The calling thread takes part as well, so the tracking progresses even when all workers are busy
+  schedule->run(track_chunk);
+  schedule->wait();
+}
@@ -0,0 +1,208 @@
+#include <motion_tracker/metrics.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace metrics
+{
+
+static constexpr unsigned sub_bucket_bits = 4;
+static constexpr uint64_t sub_buckets = uint64_t(1) << sub_bucket_bits;
+static constexpr unsigned max_exponent = 40; // 2^40 ns, larger values go to the last bucket
+static constexpr size_t num_buckets = (max_exponent - sub_bucket_bits + 1) * sub_buckets;
+static constexpr size_t num_stages = static_cast<size_t>(Stage::Count);
+
+// Values below 16 ns have a bucket each, above that the bucket is given by the exponent and the
+//  4 bits below the leading one.
+static size_t bucketOf(uint64_t value)
+{
+  if (value < sub_buckets)
+  {
+    return value;
+  }
+
+  unsigned exponent = 63 - __builtin_clzll(value);
+  if (exponent >= max_exponent)
+  {
+    return num_buckets - 1;
+  }
+  return (exponent - sub_bucket_bits + 1) * sub_buckets + ((value >> (exponent - sub_bucket_bits)) & (sub_buckets - 1));
+}
+
+// The largest value of <bucket>
+static uint64_t bucketLimit(size_t bucket)
+{
+  if (bucket < sub_buckets)
+  {
+    return bucket;
+  }
+
+  unsigned exponent = bucket / sub_buckets + sub_bucket_bits - 1;
+  uint64_t sub_bucket = bucket % sub_buckets;
+  return ((sub_buckets + sub_bucket + 1) << (exponent - sub_bucket_bits)) - 1;
+}
+
+struct Histogram
+{
+  std::array<std::atomic<uint64_t>, num_buckets> counts{};
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> sum{0}; // [ns]
+  std::atomic<uint64_t> max{0}; // [ns]
+
+  // Only called by the thread owning the shard, so plain loads and stores are enough
+  void add(uint64_t value)
+  {
+    auto& bucket = counts[bucketOf(value)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    sum.store(sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    if (value > max.load(std::memory_order_relaxed))
+    {
+      max.store(value, std::memory_order_relaxed);
+    }
+  }
+};
+
+using Shard = std::array<Histogram, num_stages>;
+
+// The shards are kept after their threads exit, so the histograms cover the whole run.
+struct Registry
+{
+  std::mutex lock;
+  std::vector<std::unique_ptr<Shard>> shards;
+};
+
+static Registry& registry()
+{
+  static Registry instance;
+  return instance;
+}
+
+static Shard& localShard()
+{
+  thread_local Shard* shard = nullptr;
+  if (shard == nullptr)
+  {
+    auto& shards = registry();
+    std::lock_guard<std::mutex> _(shards.lock);
+    shards.shards.push_back(std::make_unique<Shard>());
+    shard = shards.shards.back().get();
+  }
+  return *shard;
+}
+
+const char* stageName(Stage stage)
+{
+  switch (stage)
+  {
+    case Stage::Grab: return "grab";
+    case Stage::Undistort: return "undistort";
+    case Stage::GrayConversion: return "gray_conversion";
+    case Stage::CornerDetection: return "corner_detection";
+    case Stage::OpticalFlow: return "optical_flow";
+    case Stage::MotionEstimation: return "motion_estimation";
+    case Stage::OverlayRendering: return "overlay_rendering";
+    case Stage::JpegEncode: return "jpeg_encode";
+    case Stage::Count: break;
+  }
+  return "unknown";
+}
+
+void record(Stage stage, std::chrono::steady_clock::duration latency)
+{
+  auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count();
+  localShard()[static_cast<size_t>(stage)].add(std::max<int64_t>(nanoseconds, 0));
+}
+
+Summary summary(Stage stage)
+{
+  std::vector<uint64_t> counts(num_buckets, 0);
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  uint64_t max = 0;
+  {
+    auto& shards = registry();
+    std::lock_guard<std::mutex> _(shards.lock);
+    for (const auto& shard : shards.shards)
+    {
+      const auto& histogram = (*shard)[static_cast<size_t>(stage)];
+      for (size_t i = 0; i < num_buckets; ++i)
+      {
+        counts[i] += histogram.counts[i].load(std::memory_order_relaxed);
+      }
+      count += histogram.count.load(std::memory_order_relaxed);
+      sum += histogram.sum.load(std::memory_order_relaxed);
+      max = std::max(max, histogram.max.load(std::memory_order_relaxed));
+    }
+  }
+
+  // The shards are read while their threads keep recording, so the buckets may add up to slightly
+  //  more than <count>; the quantiles are taken from the buckets' own total.
+  uint64_t bucket_total = 0;
+  for (auto bucket_count : counts)
+  {
+    bucket_total += bucket_count;
+  }
+
+  auto quantile = [&](double q)
+  {
+    if (bucket_total == 0)
+    {
+      return 0.0;
+    }
+
+    uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * bucket_total + 0.5));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < num_buckets; ++i)
+    {
+      seen += counts[i];
+      if (seen >= rank)
+      {
+        return std::min(bucketLimit(i), max) * 1e-9;
+      }
+    }
+    return max * 1e-9;
+  };
+
+  return Summary{count, sum * 1e-9, quantile(0.5), quantile(0.99), max * 1e-9};
+}
+
+std::string prometheusText()
+{
+  std::string text;
+  text += "# HELP motion_tracker_stage_latency_seconds Latency of the processing stages.\n";
+  text += "# TYPE motion_tracker_stage_latency_seconds summary\n";
+
+  std::string maxima;
+  maxima += "# HELP motion_tracker_stage_latency_max_seconds Largest latency of the processing stages.\n";
+  maxima += "# TYPE motion_tracker_stage_latency_max_seconds gauge\n";
+
+  char line[256];
+  for (size_t i = 0; i < num_stages; ++i)
+  {
+    auto stage = static_cast<Stage>(i);
+    auto values = summary(stage);
+    const char* name = stageName(stage);
+
+    snprintf(line, sizeof(line), "motion_tracker_stage_latency_seconds{stage=\"%s\",quantile=\"0.5\"} %.9g\n", name, values.p50);
+    text += line;
+    snprintf(line, sizeof(line), "motion_tracker_stage_latency_seconds{stage=\"%s\",quantile=\"0.99\"} %.9g\n", name, values.p99);
+    text += line;
+    snprintf(line, sizeof(line), "motion_tracker_stage_latency_seconds_sum{stage=\"%s\"} %.9g\n", name, values.sum);
+    text += line;
+    snprintf(line, sizeof(line), "motion_tracker_stage_latency_seconds_count{stage=\"%s\"} %llu\n", name,
+      static_cast<unsigned long long>(values.count));
+    text += line;
+
+    snprintf(line, sizeof(line), "motion_tracker_stage_latency_max_seconds{stage=\"%s\"} %.9g\n", name, values.max);
+    maxima += line;
+  }
+
+  return text + maxima;
+}
+
+}
@@ -1,7 +1,46 @@
 #include <motion_tracker/motion_estimation.h>
+#include <motion_tracker/motion_kernels.h>
+#include <motion_tracker/camera_model.h>
+#include <motion_tracker/metrics.h>
+#include <motion_tracker/tracing.h>
 #include <algorithm>
+#include <cmath>
+#include <limits>
 
-std::pair<double, std::vector<bool>> getTurnRateAndValidIndicatorFromFlow(const CameraConfig& params, const std::vector<OpticFlow>& flow)
+// Median of the values of the valid flow vectors, which are compacted to the front of <values>
+//  first. Vectors with a NaN value are marked invalid in <flow>.
+template<class T>
+static double validMedian(FlowBatch& flow, std::vector<T>& values, size_t& num_valid)
+{
+  num_valid = 0;
+  for (size_t i = 0; i < flow.size(); ++i)
+  {
+    if (!flow.isValid(i))
+    {
+      continue;
+    }
+
+    if (std::isnan(values[i]))
+    {
+      flow.invalidate(i);
+      continue;
+    }
+    values[num_valid++] = values[i];
+  }
+
+  if (num_valid < 2)
+  {
+    return 0.0;
+  }
+
+  // Only the median is needed, which the selection finds in linear time
+  auto median = values.begin() + num_valid / 2;
+  std::nth_element(values.begin(), median, values.begin() + num_valid);
+
+  return *median;
+}
+
+static double estimateTurnRate(const CameraConfig& params, FlowBatch& flow, std::vector<float>& angular_flow, size_t& num_valid)
 {
 
   // As per the paper, the points are to be projected to a cylindrical frame and the flow (angular
@@ -15,97 +54,203 @@ std::pair<double, std::vector<bool>> getTurnRateAndValidIndicatorFromFlow(const
   //  focal length of the camera.
 
 
-  std::vector<double> angular_flow;
-  angular_flow.reserve(flow.size());
+  // The projection of all the vectors is calculated at once, with a SIMD kernel
+  angular_flow.resize(flow.size());
+  cylindricalAngularFlow(flow.start_x.data(), flow.end_x.data(), flow.size(), params.img_width, params.focal_length, angular_flow.data());
 
-  std::vector<bool> valid_flow;
-  valid_flow.reserve(flow.size());
+  double median = validMedian(flow, angular_flow, num_valid);
+  return num_valid < 2 ? 0.0 : median / flow.dt;
+}
 
-  for (const auto& flow_element : flow)
-  {
-    double sin_start = (2.0*flow_element.start.x - params.img_width) / params.focal_length;
-    double sin_end = (2.0*flow_element.end.x - params.img_width) / params.focal_length;
-    double angle_start = asin(sin_start);
-    double angle_end = asin(sin_end);
+static double estimateSpeed(const GroundProjection& projection, FlowBatch& flow, double turn_rate, std::vector<double>& linear_flow, size_t& num_valid)
+{
+  // The displacement of the camera can be calculated by projecting the flow onto the ground plane,
+  //  and removing the effects of the rotation from the observed flow. As per the paper, the magnitude
+  //  of the resulting flow vectors is an indication of the forward translation of the camera.
 
-    double f = angle_end - angle_start;
-    valid_flow.emplace_back(!std::isnan(f));
+  linear_flow.resize(flow.size());
 
-    if (valid_flow.back())
-    {
-      angular_flow.emplace_back(f);
-    }
-  }
-  std::sort(angular_flow.begin(), angular_flow.end());
+  const float* start_x = flow.start_x.data();
+  const float* start_y = flow.start_y.data();
+  const float* end_x = flow.end_x.data();
+  const float* end_y = flow.end_y.data();
 
-  if (angular_flow.size() < 2)
+  // The trigonometry of the projection only depends on the pixel coordinates, so it is looked up
+  for (size_t i = 0; i < flow.size(); ++i)
   {
-    return std::make_pair<double, std::vector<bool>>(0.0, {false});
+    double s_x, s_y, e_x, e_y;
+    projection.project(start_x[i], start_y[i], s_x, s_y);
+    projection.project(end_x[i], end_y[i], e_x, e_y);
+
+    double dx = e_x - s_x - turn_rate * s_y;
+    double dy = e_y - s_y;
+
+    linear_flow[i] = hypot(dx, dy);
   }
 
-  double yaw_speed = angular_flow[angular_flow.size() / 2] / flow.front().dt;
-  return std::make_pair(yaw_speed, valid_flow);
+  double median = validMedian(flow, linear_flow, num_valid);
+  return num_valid < 2 ? 0.0 : median / flow.dt;
 }
 
-std::pair<double, std::vector<bool>> getSpeedAndValidIndicatorFromFlow(const CameraConfig& params, const std::vector<OpticFlow>& flow, double turn_rate)
+double getTurnRateFromFlow(const CameraConfig& params, FlowBatch& flow)
 {
-  // The displacement of the camera can be calculated by projecting the flow onto the ground plane,
-  //  and removing the effects of the rotation from the observed flow. As per the paper, the magnitude
-  //  of the resulting flow vectors is an indication of the forward translation of the camera.
+  tracing::Span span("getTurnRateFromFlow");
+  thread_local std::vector<float> angular_flow;
+  size_t num_valid;
+  return estimateTurnRate(params, flow, angular_flow, num_valid);
+}
 
-  std::vector<double> linear_flow;
-  linear_flow.reserve(flow.size());
+double getSpeedFromFlow(const CameraConfig& params, FlowBatch& flow, double turn_rate)
+{
+  tracing::Span span("getSpeedFromFlow");
+  thread_local std::vector<double> linear_flow;
+  size_t num_valid;
+  return estimateSpeed(groundProjection(params), flow, turn_rate, linear_flow, num_valid);
+}
 
-  std::vector<bool> valid_flow;
-  valid_flow.reserve(flow.size());
+// The estimation with the constants of a known camera model compiled in. With the pitch known, the
+//  ground projection reduces to a rational function of the pixel coordinates:
+//
+//      depth = h*f / ((2*y - H)*cos(pitch) + f*sin(pitch))
+//      x = depth * (2*x - W)/f,  y = depth * (f*cos(pitch) - (2*y - H)*sin(pitch))/f
+template<class Model>
+static double estimateTurnRateWithModel(FlowBatch& flow, std::vector<float>& angular_flow, size_t& num_valid)
+{
+  angular_flow.resize(flow.size());
+  cylindricalAngularFlow(flow.start_x.data(), flow.end_x.data(), flow.size(), Model::img_width, Model::focal_length, angular_flow.data());
+
+  double median = validMedian(flow, angular_flow, num_valid);
+  return num_valid < 2 ? 0.0 : median / flow.dt;
+}
 
-  for (const auto& flow_element : flow)
+template<class Model>
+static double estimateSpeedWithModel(FlowBatch& flow, double turn_rate, std::vector<double>& linear_flow, size_t& num_valid)
+{
+  constexpr double f_sin_pitch = Model::focal_length * Model::sin_pitch;
+  constexpr double f_cos_pitch = Model::focal_length * Model::cos_pitch;
+
+  auto project = [](double x, double y, double& ground_x, double& ground_y)
   {
-    double s_elevation = atan2(2.0 * flow_element.start.y - params.img_height, params.focal_length);
-    double s_azimuth = atan2(2.0 * flow_element.start.x - params.img_width, params.focal_length);
+    double row = 2.0 * y - Model::img_height;
+    double depth_scale = Model::ground_height / (row * Model::cos_pitch + f_sin_pitch);
 
-    double e_elevation = atan2(2.0 * flow_element.end.y - params.img_height, params.focal_length);
-    double e_azimuth = atan2(2.0 * flow_element.end.x - params.img_width, params.focal_length);
+    ground_x = (2.0 * x - Model::img_width) * depth_scale;
+    ground_y = (f_cos_pitch - row * Model::sin_pitch) * depth_scale;
+  };
 
-    double s_depth = params.ground_height * cos(s_elevation) / sin(s_elevation + params.camera_pitch);
-    double e_depth = params.ground_height * cos(e_elevation) / sin(e_elevation + params.camera_pitch);
+  linear_flow.resize(flow.size());
+  for (size_t i = 0; i < flow.size(); ++i)
+  {
+    double s_x, s_y, e_x, e_y;
+    project(flow.start_x[i], flow.start_y[i], s_x, s_y);
+    project(flow.end_x[i], flow.end_y[i], e_x, e_y);
 
-    double s_x = s_depth * tan(s_azimuth);
-    double s_y = params.ground_height / tan(s_elevation + params.camera_pitch);
+    linear_flow[i] = hypot(e_x - s_x - turn_rate * s_y, e_y - s_y);
+  }
 
-    double e_x = e_depth * tan(e_azimuth);
-    double e_y = params.ground_height / tan(e_elevation + params.camera_pitch);
+  double median = validMedian(flow, linear_flow, num_valid);
+  return num_valid < 2 ? 0.0 : median / flow.dt;
+}
 
-    double dx = e_x - s_x - turn_rate * s_y;
-    double dy = e_y - s_y;
+struct OdometryEstimator::ModelEntry
+{
+  bool (*matches)(const CameraConfig&);
+  double (*turn_rate)(FlowBatch&, std::vector<float>&, size_t&);
+  double (*speed)(FlowBatch&, double, std::vector<double>&, size_t&);
+};
 
-    double speed_estimate = hypot(dx, dy);
+template<class Model>
+static constexpr OdometryEstimator::ModelEntry modelEntry()
+{
+  return {&Model::matches, &estimateTurnRateWithModel<Model>, &estimateSpeedWithModel<Model>};
+}
 
-    valid_flow.emplace_back(!std::isnan(speed_estimate));
+// The camera models with a specialized estimation; configs matching none of them use the generic one.
+static const OdometryEstimator::ModelEntry camera_models[] = {
+  modelEntry<camera_model::Model<camera_model::ForwardVga>>(),
+};
 
-    if (valid_flow.back())
+static const OdometryEstimator::ModelEntry* findModel(const CameraConfig& config)
+{
+  for (const auto& model : camera_models)
+  {
+    if (model.matches(config))
     {
-      linear_flow.emplace_back(speed_estimate);
+      return &model;
     }
   }
-  std::sort(linear_flow.begin(), linear_flow.end());
+  return nullptr;
+}
+
+OdometryEstimator::OdometryEstimator(const CameraConfig& config, bool use_camera_models)
+  : config_(config)
+  , projection_(config)
+  , model_(use_camera_models ? findModel(config) : nullptr)
+{
+}
 
-  if (linear_flow.size() < 2)
+OdometryEstimate OdometryEstimator::estimate(FlowBatch& rotation_flow, FlowBatch& translation_flow)
+{
+  return estimateFrom(&rotation_flow, &translation_flow, 0);
+}
+
+// Seconds from <measured> to <now>, infinite if the estimate was not measured yet
+static double ageOf(const std::optional<OdometryEstimator::TimeStamp>& measured, OdometryEstimator::TimeStamp now)
+{
+  if (!measured.has_value())
   {
-    return std::make_pair<double, std::vector<bool>>(0.0, {false});
+    return std::numeric_limits<double>::infinity();
   }
-  double linear_speed = linear_flow[linear_flow.size() / 2] / flow.front().dt;
-  return std::make_pair(linear_speed, valid_flow);
+  return std::chrono::duration<double>(now - *measured).count();
 }
 
-double getTurnRateFromFlow(const CameraConfig& params, const std::vector<OpticFlow>& flow)
+OdometryEstimate OdometryEstimator::estimate(FlowBatch* rotation_flow, FlowBatch* translation_flow, TimeStamp stamp)
 {
-  auto [turn_rate, valid_indicator] = getTurnRateAndValidIndicatorFromFlow(params, flow);
-  return turn_rate;
+  OdometryEstimate result = estimateFrom(rotation_flow, translation_flow, held_.turn_rate);
+
+  if (rotation_flow != nullptr)
+  {
+    turn_rate_stamp_ = stamp;
+  }
+  else
+  {
+    result.rotation_vectors = held_.rotation_vectors;
+  }
+
+  if (translation_flow != nullptr)
+  {
+    speed_stamp_ = stamp;
+  }
+  else
+  {
+    result.speed = held_.speed;
+    result.translation_vectors = held_.translation_vectors;
+  }
+
+  result.turn_rate_age = ageOf(turn_rate_stamp_, stamp);
+  result.speed_age = ageOf(speed_stamp_, stamp);
+
+  held_ = result;
+  return result;
 }
 
-double getSpeedFromFlow(const CameraConfig& params, const std::vector<OpticFlow>& flow, double turn_rate)
+OdometryEstimate OdometryEstimator::estimateFrom(FlowBatch* rotation_flow, FlowBatch* translation_flow, double held_turn_rate)
 {
-  auto [displacement, valid_indicator] = getSpeedAndValidIndicatorFromFlow(params, flow, turn_rate);
-  return displacement;
-}
\ No newline at end of file
+  metrics::ScopedLatency latency(metrics::Stage::MotionEstimation);
+  tracing::Span span("OdometryEstimator::estimate");
+
+  OdometryEstimate result;
+  result.turn_rate = held_turn_rate;
+  if (rotation_flow != nullptr)
+  {
+    result.turn_rate = model_ != nullptr ? model_->turn_rate(*rotation_flow, angular_flow_, result.rotation_vectors)
+                                         : estimateTurnRate(config_, *rotation_flow, angular_flow_, result.rotation_vectors);
+    compensation_turn_rate_ = turn_rate_filter_.push(result.turn_rate);
+  }
+  if (translation_flow != nullptr)
+  {
+    result.speed = model_ != nullptr ? model_->speed(*translation_flow, compensation_turn_rate_, linear_flow_, result.translation_vectors)
+                                     : estimateSpeed(projection_, *translation_flow, compensation_turn_rate_, linear_flow_, result.translation_vectors);
+  }
+  return result;
+}
@@ -0,0 +1,92 @@
+#include <motion_tracker/motion_kernels.h>
+#include <motion_tracker/simd.h>
+#include <cmath>
+#include <limits>
+
+// Coefficients of the polynomial approximating (asin(x) - x) / x^3 on [0, 0.25] in x^2. Above
+//  |x| = 0.5 the identity asin(x) = pi/2 - 2*asin(sqrt((1 - x)/2)) brings the argument into range.
+static constexpr float asin_p0 = 1.6666752422e-1f;
+static constexpr float asin_p1 = 7.4953002686e-2f;
+static constexpr float asin_p2 = 4.5470025998e-2f;
+static constexpr float asin_p3 = 2.4181311049e-2f;
+static constexpr float asin_p4 = 4.2163199048e-2f;
+static constexpr float half_pi = 1.57079632679489661923f;
+
+float fastAsin(float x)
+{
+  float a = std::fabs(x);
+  if (!(a <= 1.f))
+  {
+    return std::numeric_limits<float>::quiet_NaN();
+  }
+
+  bool reduced = a > 0.5f;
+  float z = reduced ? 0.5f * (1.f - a) : a * a;
+  float s = reduced ? std::sqrt(z) : a;
+
+  float p = (((asin_p4 * z + asin_p3) * z + asin_p2) * z + asin_p1) * z + asin_p0;
+  float r = s + s * z * p;
+  r = reduced ? half_pi - 2.f * r : r;
+
+  return std::copysign(r, x);
+}
+
+// The same computation as fastAsin, branch free over a vector.
+template<class Ops>
+static inline typename Ops::f32 asinVector(typename Ops::f32 x)
+{
+  auto one = Ops::set_f32(1.f);
+  auto half = Ops::set_f32(0.5f);
+
+  auto a = Ops::abs_f32(x);
+  auto reduced = Ops::gt_f32(a, half);
+  auto z = Ops::select_f32(reduced, Ops::mul_f32(half, Ops::sub_f32(one, a)), Ops::mul_f32(a, a));
+  auto s = Ops::select_f32(reduced, Ops::sqrt_f32(z), a);
+
+  auto p = Ops::set_f32(asin_p4);
+  p = Ops::add_f32(Ops::mul_f32(p, z), Ops::set_f32(asin_p3));
+  p = Ops::add_f32(Ops::mul_f32(p, z), Ops::set_f32(asin_p2));
+  p = Ops::add_f32(Ops::mul_f32(p, z), Ops::set_f32(asin_p1));
+  p = Ops::add_f32(Ops::mul_f32(p, z), Ops::set_f32(asin_p0));
+
+  auto r = Ops::add_f32(s, Ops::mul_f32(Ops::mul_f32(s, z), p));
+  r = Ops::select_f32(reduced, Ops::sub_f32(Ops::set_f32(half_pi), Ops::add_f32(r, r)), r);
+  r = Ops::or_f32(r, Ops::sign_f32(x));
+
+  return Ops::select_f32(Ops::gt_f32(a, one), Ops::set_f32(std::numeric_limits<float>::quiet_NaN()), r);
+}
+
+template<class Ops>
+static void cylindricalAngularFlowKernel(const float* start_x, const float* end_x, size_t count, float width, float focal_length, float* angular_flow)
+{
+  // sin(angle) = (2*x - width)/f = x*scale - offset
+  const float scale = 2.f / focal_length;
+  const float offset = width / focal_length;
+
+  auto scale_v = Ops::set_f32(scale);
+  auto offset_v = Ops::set_f32(offset);
+
+  size_t i = 0;
+  for (; i + Ops::f32_lanes <= count; i += Ops::f32_lanes)
+  {
+    auto sin_start = Ops::sub_f32(Ops::mul_f32(Ops::load_f32(start_x + i), scale_v), offset_v);
+    auto sin_end = Ops::sub_f32(Ops::mul_f32(Ops::load_f32(end_x + i), scale_v), offset_v);
+
+    Ops::store_f32(angular_flow + i, Ops::sub_f32(asinVector<Ops>(sin_end), asinVector<Ops>(sin_start)));
+  }
+
+  for (; i < count; ++i)
+  {
+    angular_flow[i] = fastAsin(end_x[i] * scale - offset) - fastAsin(start_x[i] * scale - offset);
+  }
+}
+
+void cylindricalAngularFlow(const float* start_x, const float* end_x, size_t count, float width, float focal_length, float* angular_flow)
+{
+  cylindricalAngularFlowKernel<simd::NativeOps>(start_x, end_x, count, width, focal_length, angular_flow);
+}
+
+const char* motionKernelInstructionSet()
+{
+  return simd::NativeOps::name;
+}
@@ -0,0 +1,393 @@
+#include <motion_tracker/odometry_host.h>
+#include <motion_tracker/tracking_budget.h>
+#include <motion_tracker/tracing.h>
+#include <cpp-toolkit/moving_average.h>
+#include <algorithm>
+#include <cstdio>
+#include <thread>
+
+static constexpr size_t pipeline_queue_depth = 2;
+static constexpr size_t pyramid_cache_size = 8; // The frames in flight, besides the ones the trackers hold on to
+static constexpr int refine_window = 11;
+
+// A slow frame dumps the trace at most this often, so a stall does not end up writing a trace per frame
+static constexpr std::chrono::seconds slow_frame_trace_interval(10);
+
+// The turn rate is estimated from the upper half of the frame and the speed from the ground seen in
+//  the lower half.
+static std::vector<TrackedRegion> defaultRegions(unsigned int width, unsigned int height, const ChannelSettings& settings)
+{
+  constexpr size_t points_per_region = 200;
+  return {
+    {"top", Rect<unsigned int>(0, 0, width, height / 2), TrackedRegion::Role::Yaw, points_per_region, 1, settings.yaw_rate},
+    {"bottom", Rect<unsigned int>(0, height / 2, width, height), TrackedRegion::Role::Speed, points_per_region, 1, settings.speed_rate}
+  };
+}
+
+// The regions of <settings>, limited to the frame, or the default ones if there are none.
+static std::vector<TrackedRegion> channelRegions(unsigned int width, unsigned int height, const ChannelSettings& settings)
+{
+  std::vector<TrackedRegion> regions;
+  for (auto region : settings.regions)
+  {
+    const auto& roi = region.roi;
+    region.roi = Rect<unsigned int>(std::min(roi.start_x, width), std::min(roi.start_y, height), std::min(roi.end_x, width), std::min(roi.end_y, height));
+    if (region.roi.end_x <= region.roi.start_x || region.roi.end_y <= region.roi.start_y || region.num_points == 0)
+    {
+      printf("WARNING: Region %s has no points or lies outside of the %ux%u frame, it is not tracked!\n", region.name.c_str(), width, height);
+      continue;
+    }
+    regions.push_back(std::move(region));
+  }
+
+  if (regions.empty())
+  {
+    return defaultRegions(width, height, settings);
+  }
+  return regions;
+}
+
+struct OdometryChannel::Internals
+{
+  Internals(const ChannelSettings& settings, const CameraConfig& config)
+    : pyramids(cv::Size(OpticFlowTracker::window_size, OpticFlowTracker::window_size), OpticFlowTracker::pyramid_levels,
+        pyramid_cache_size, settings.tracking_scale, settings.refine ? refine_window : 0)
+    , estimator(config)
+  {}
+
+  // Every frame's pyramid is built once and shared by all regions. With a tracking scale below 1
+  //  they are built from downscaled frames, optionally with the full resolution level kept for
+  //  refining the results.
+  PyramidCache pyramids;
+  std::unique_ptr<RegionManager> regions;
+  std::unique_ptr<BudgetController> budget_controller;
+
+  OdometryEstimator estimator;
+  MovingAverage<double, 3> turn_rate_filter;
+  MovingAverage<double, 3> linear_speed_filter;
+
+  // Owned by the estimate stage
+  double yaw_speed = 0;
+  double linear_speed = 0;
+  double total_turn = 0;
+  double total_dist = 0;
+  Frame::TimeStamp last_stamp;
+
+  // Owned by the publish stage
+  std::chrono::steady_clock::time_point last_published;
+
+  mutable std::mutex latency_lock;
+  LatencyStats latency;
+  std::chrono::steady_clock::time_point last_trace_dump; // Owned by the publish stage
+  std::thread trace_writer;                              // Started by the publish stage, joined by wait()
+
+  std::unique_ptr<FramePipeline> pipeline;
+};
+
+OdometryChannel::OdometryChannel(size_t index, std::unique_ptr<FrameSource> source, const ChannelSettings& settings, ThreadPool& workers,
+  std::unique_ptr<FrameRecorder> recorder)
+  : index_(index)
+  , settings_(settings)
+  , source_(std::move(source))
+  , recorder_(std::move(recorder))
+  , workers_(workers)
+  , internals_(std::make_unique<Internals>(settings, source_->config()))
+{
+}
+
+OdometryChannel::~OdometryChannel()
+{
+  stop();
+  wait();
+}
+
+bool OdometryChannel::start(Publisher publish)
+{
+  auto first_frame = source_->grab();
+  if (!first_frame.has_value())
+  {
+    return false;
+  }
+  auto initial_frame = first_frame->toGray();
+  auto& internals = *internals_;
+
+  auto initial_pyramid = internals.pyramids.build(initial_frame);
+  internals.regions = std::make_unique<RegionManager>(initial_pyramid,
+    channelRegions(initial_frame.data().cols, initial_frame.data().rows, settings_), workers_, settings_.detector);
+  initial_pyramid.reset();
+
+  internals.regions->setEngine(settings_.lk_engine);
+
+  // The regions trade quality for time whenever the tracking takes longer than the target period
+  auto target_period = std::chrono::duration_cast<BudgetController::Duration>(std::chrono::duration<double>(1.0 / settings_.target_fps));
+  internals.budget_controller = std::make_unique<BudgetController>(target_period,
+    TrackingBudget{internals.regions->totalPoints(), OpticFlowTracker::window_size, 1});
+
+  internals.last_stamp = initial_frame.stamp();
+  internals.last_published = std::chrono::steady_clock::now();
+
+  auto overflow_policy = settings_.drop_frames ? FramePipeline::OverflowPolicy::DropNewest : FramePipeline::OverflowPolicy::Block;
+
+  internals.pipeline = std::make_unique<FramePipeline>([this](FramePacket& packet)
+  {
+    auto frame = source_->grab();
+    if (!frame.has_value())
+    {
+      return false;
+    }
+    if (recorder_)
+    {
+      recorder_->record(frame.value());
+    }
+    packet.camera = index_;
+    packet.frame = std::move(frame.value());
+
+    // A live frame's latency includes the grab and the time it waited in the camera's buffer
+    packet.produced = std::chrono::steady_clock::now();
+    if (source_->stampsCaptureTime())
+    {
+      packet.produced = std::min(packet.produced, packet.frame.stamp());
+    }
+    return true;
+  });
+  internals.pipeline->setStartTime([](const FramePacket& packet) { return packet.produced; });
+
+  internals.pipeline->addStage("preprocess", [this](FramePacket& packet)
+  {
+    packet.pyramid = internals_->pyramids.build(packet.frame.toGray(source_->pool()));
+    return true;
+  }, pipeline_queue_depth, overflow_policy);
+
+  internals.pipeline->addStage("track", [this](FramePacket& packet)
+  {
+    auto& internals = *internals_;
+    auto tracking_start = std::chrono::steady_clock::now();
+
+    internals.regions->track(packet.pyramid, packet.flows);
+
+    // The trackers keep the pyramid they need, so the cache can reuse the others sooner
+    packet.pyramid.reset();
+
+    // Only the tracking is budgeted, the other stages run alongside it
+    const auto& budget = internals.budget_controller->update(std::chrono::steady_clock::now() - tracking_start);
+    internals.regions->setBudget(budget);
+    packet.load = internals.budget_controller->load();
+    packet.degradation = internals.budget_controller->degradationLevel();
+    return true;
+  }, pipeline_queue_depth, overflow_policy);
+
+  internals.pipeline->addStage("estimate", [this](FramePacket& packet)
+  {
+    auto& internals = *internals_;
+    auto& flows = packet.flows;
+    auto estimate = internals.estimator.estimate(flows.rotation_tracked ? &flows.rotation : nullptr,
+      flows.translation_tracked ? &flows.translation : nullptr, packet.frame.stamp());
+
+    // Held estimates, and the placeholders before the first measurement, are not measurements, so
+    //  only the fresh ones are filtered
+    if (estimate.turn_rate_age == 0)
+    {
+      internals.yaw_speed = internals.turn_rate_filter.push(estimate.turn_rate);
+    }
+    if (estimate.speed_age == 0)
+    {
+      internals.linear_speed = internals.linear_speed_filter.push(estimate.speed);
+    }
+    packet.yaw_speed = internals.yaw_speed;
+    packet.linear_speed = internals.linear_speed;
+    packet.yaw_speed_age = estimate.turn_rate_age;
+    packet.linear_speed_age = estimate.speed_age;
+    packet.rotation_vectors = estimate.rotation_vectors;
+    packet.translation_vectors = estimate.translation_vectors;
+
+    // Integrated over the time between the frames rather than the processing time
+    double dt = std::chrono::duration<double>(packet.frame.stamp() - internals.last_stamp).count();
+    internals.last_stamp = packet.frame.stamp();
+    internals.total_turn += packet.yaw_speed * dt;
+    internals.total_dist += packet.linear_speed * dt;
+    packet.total_turn = internals.total_turn;
+    packet.total_dist = internals.total_dist;
+    return true;
+  }, pipeline_queue_depth, overflow_policy);
+
+  internals.pipeline->addStage("publish", [this, publish](FramePacket& packet)
+  {
+    auto now = std::chrono::steady_clock::now();
+    packet.fps = 1.0 / std::chrono::duration<double>(now - internals_->last_published).count();
+    packet.latency = std::chrono::duration<double, std::milli>(now - packet.produced).count();
+    internals_->last_published = now;
+
+    publish(packet);
+
+    // Hands the buffer back to the source's pool rather than keeping it until the packet is reused
+    packet.frame = Frame();
+    return true;
+  }, pipeline_queue_depth, overflow_policy);
+
+  internals.pipeline->setLatencyCallback([this](const FramePacket&, FramePipeline::Clock::duration latency)
+  {
+    double latency_ms = std::chrono::duration<double, std::milli>(latency).count();
+
+    size_t frames;
+    {
+      std::lock_guard<std::mutex> _(internals_->latency_lock);
+      auto& stats = internals_->latency;
+      frames = ++stats.frames;
+      stats.last = latency_ms;
+      stats.mean += (latency_ms - stats.mean) / stats.frames;
+      stats.max = std::max(stats.max, latency_ms);
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (settings_.trace_slow_frame > 0 && latency_ms > settings_.trace_slow_frame && tracing::enabled() &&
+        now - internals_->last_trace_dump > slow_frame_trace_interval)
+    {
+      internals_->last_trace_dump = now;
+      std::string path = "trace_camera" + std::to_string(index_) + "_frame" + std::to_string(frames) + ".json";
+
+      // Written off the publish thread, so the dump does not stall the camera it is about. The
+      //  previous one finished long ago, given the interval between them.
+      if (internals_->trace_writer.joinable())
+      {
+        internals_->trace_writer.join();
+      }
+      internals_->trace_writer = std::thread([index = index_, frames, latency_ms, path]()
+      {
+        if (tracing::dump(path))
+        {
+          printf("Camera %zu: frame %zu took %.1f [ms], trace written to %s\n", index, frames, latency_ms, path.c_str());
+        }
+      });
+    }
+  });
+
+  internals.pipeline->start();
+  return true;
+}
+
+void OdometryChannel::stop()
+{
+  if (internals_->pipeline)
+  {
+    internals_->pipeline->stop();
+  }
+}
+
+void OdometryChannel::wait()
+{
+  if (internals_->pipeline)
+  {
+    internals_->pipeline->wait();
+  }
+  if (internals_->trace_writer.joinable())
+  {
+    internals_->trace_writer.join();
+  }
+}
+
+size_t OdometryChannel::maxDegradationLevel() const
+{
+  return internals_->budget_controller ? internals_->budget_controller->maxDegradationLevel() : 0;
+}
+
+LatencyStats OdometryChannel::latency() const
+{
+  std::lock_guard<std::mutex> _(internals_->latency_lock);
+  return internals_->latency;
+}
+
+std::vector<FramePipeline::StageStats> OdometryChannel::stageStats() const
+{
+  return internals_->pipeline ? internals_->pipeline->stats() : std::vector<FramePipeline::StageStats>();
+}
+
+OdometryHost::OdometryHost(size_t num_workers)
+  : workers_(num_workers > 0 ? num_workers : std::max(1u, std::thread::hardware_concurrency()))
+{
+}
+
+OdometryHost::~OdometryHost()
+{
+  stop();
+  channels_.clear();
+}
+
+size_t OdometryHost::addCamera(std::unique_ptr<FrameSource> source, const ChannelSettings& settings, std::unique_ptr<FrameRecorder> recorder)
+{
+  size_t index = channels_.size();
+  channels_.push_back(std::make_unique<OdometryChannel>(index, std::move(source), settings, workers_, std::move(recorder)));
+  latest_.emplace_back();
+  return index;
+}
+
+bool OdometryHost::run(const OdometryChannel::Publisher& publish)
+{
+  bool all_started = true;
+  for (auto& channel : channels_)
+  {
+    bool started = channel->start([this, &publish](FramePacket& packet)
+    {
+      aggregate(packet);
+      publish(packet);
+    });
+
+    if (!started)
+    {
+      printf("No frames available from camera %zu!\n", channel->index());
+      all_started = false;
+    }
+  }
+
+  for (auto& channel : channels_)
+  {
+    channel->wait();
+  }
+  return all_started;
+}
+
+void OdometryHost::stop()
+{
+  for (auto& channel : channels_)
+  {
+    channel->stop();
+  }
+}
+
+AggregatedOdometry OdometryHost::odometry() const
+{
+  std::lock_guard<std::mutex> _(lock_);
+  return odometry_;
+}
+
+void OdometryHost::aggregate(const FramePacket& packet)
+{
+  std::lock_guard<std::mutex> _(lock_);
+  latest_[packet.camera] = CameraOdometry{packet.yaw_speed, packet.linear_speed, packet.rotation_vectors, packet.translation_vectors,
+    packet.total_turn, packet.total_dist};
+
+  AggregatedOdometry result;
+  double rotation_weight = 0;
+  double translation_weight = 0;
+  for (const auto& camera : latest_)
+  {
+    if (!camera.has_value())
+    {
+      continue;
+    }
+
+    result.turn_rate += camera->turn_rate * camera->rotation_vectors;
+    result.speed += camera->speed * camera->translation_vectors;
+    rotation_weight += camera->rotation_vectors;
+    translation_weight += camera->translation_vectors;
+
+    result.total_turn += camera->total_turn;
+    result.total_dist += camera->total_dist;
+    result.cameras++;
+  }
+
+  result.turn_rate = rotation_weight > 0 ? result.turn_rate / rotation_weight : 0.0;
+  result.speed = translation_weight > 0 ? result.speed / translation_weight : 0.0;
+  result.total_turn /= result.cameras;
+  result.total_dist /= result.cameras;
+  odometry_ = result;
+}
@@ -1,135 +1,428 @@
 #include <motion_tracker/optic_flow_tracker.h>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/video/tracking.hpp>
+#include <motion_tracker/point_grid.h>
+#include <motion_tracker/feature_detector.h>
+#include <motion_tracker/metrics.h>
+#include <motion_tracker/tracing.h>
+#include <cmath>
+#include <numeric>
+#include <algorithm>
 
-static double distanceSquared(const cv::Point2f& p1, const cv::Point2f& p2)
+// New corners are only searched for in the tiles (of 4x4 grid cells) which lack points, and only in
+//  a limited number of them per frame, so the cost of replenishing scales with the number of lost
+//  points rather than the area of the region. A tile whose search found no corner at all (sky, a
+//  plain wall) is skipped for a while, and its share of the points goes to the other tiles.
+static constexpr int detection_tile_margin = 3; // The corner response needs a few pixels of context
+static constexpr size_t detection_tiles_per_frame = 8;
+static constexpr unsigned int barren_tile_cooldown = 30; // Detections a barren tile is skipped for
+
+// Points tracked per task when the tracking is spread over the worker threads
+static constexpr size_t tracking_chunk_size = 32;
+
+struct DetectionTiles
+{
+  static constexpr int tile_size = OpticFlowTracker::detection_tile_size;
+
+  DetectionTiles(const cv::Size& area)
+    : area(area)
+    , columns(std::max(1, (area.width + tile_size - 1) / tile_size))
+    , rows(std::max(1, (area.height + tile_size - 1) / tile_size))
+    , counts(columns * rows)
+    , cooldowns(columns * rows)
+    , order(columns * rows)
+  {}
+
+  size_t index(const cv::Point2f& pt) const
+  {
+    return (static_cast<int>(pt.y) / tile_size) * columns + static_cast<int>(pt.x) / tile_size;
+  }
+
+  cv::Rect tile(size_t index) const
+  {
+    cv::Rect tile_rect((index % columns) * tile_size, (index / columns) * tile_size, tile_size, tile_size);
+    return tile_rect & cv::Rect(cv::Point(), area);
+  }
+
+  const cv::Size area;
+  const int columns;
+  const int rows;
+
+  std::vector<unsigned int> counts;
+  std::vector<unsigned int> cooldowns; // Detections left until a barren tile is searched again
+  std::vector<size_t> order;
+
+  // Same as above, for the search over the whole region once the tiles came up short
+  unsigned int region_cooldown = 0;
+  cv::Mat region_mask;
+};
+
+// Adds the corners found in the part of the region at <origin> (region coordinates) to <points>,
+//  at most <max_added>. Returns how many were added.
+static size_t addCorners(const std::vector<cv::Point2f>& found_points, const cv::Point2f& origin, size_t max_added,
+  std::vector<cv::Point2f>& points, PointGrid& grid)
 {
-  double dx = p1.x - p2.x;
-  double dy = p1.y - p2.y;
-  return dx * dx + dy * dy;
+  size_t added = 0;
+  for (const auto& found_pt : found_points)
+  {
+    if (added == max_added)
+    {
+      break;
+    }
+
+    cv::Point2f pt = found_pt + origin;
+    if (grid.tryInsert(pt))
+    {
+      points.emplace_back(pt);
+      ++added;
+    }
+  }
+  return added;
 }
 
-static std::vector<cv::Point2f> findCorners(const cv::Mat& frame, unsigned int num_points, std::vector<cv::Point2f> points = std::vector<cv::Point2f>())
+// Tops up <points> (full frame coordinates, indexed by <grid>) with corners found in <frame> (the
+//  region of interest located at <offset> in the full frame), searching at most <tile_budget> tiles.
+//  If the tiles can not make up for the missing points, the rest of the region is searched at once.
+static void findCorners(FeatureDetector& detector, const cv::Mat& frame, const cv::Point2f& offset, unsigned int num_points, size_t tile_budget,
+  std::vector<cv::Point2f>& points, PointGrid& grid, DetectionTiles& tiles, std::vector<cv::Point2f>& found_points)
 {
+  const size_t num_tiles = tiles.counts.size();
+  size_t num_barren = 0;
+  for (auto& cooldown : tiles.cooldowns)
+  {
+    cooldown -= cooldown > 0 ? 1 : 0;
+    num_barren += cooldown > 0 ? 1 : 0;
+  }
+  tiles.region_cooldown -= tiles.region_cooldown > 0 ? 1 : 0;
+
   if (points.size() >= num_points)
   {
-    return points;
+    return;
   }
 
+  metrics::ScopedLatency latency(metrics::Stage::CornerDetection);
+  tracing::Span span("findCorners");
   points.reserve(num_points);
 
-  const double min_distance = 20;
-  const double min_distance_sq = min_distance * min_distance;
+  std::fill(tiles.counts.begin(), tiles.counts.end(), 0);
+  for (const auto& pt : points)
+  {
+    cv::Point2f local_pt = pt - offset;
+    if (local_pt.x >= 0 && local_pt.y >= 0 && local_pt.x < tiles.area.width && local_pt.y < tiles.area.height)
+    {
+      ++tiles.counts[tiles.index(local_pt)];
+    }
+  }
+
+  // The points are shared out among the tiles which are not known to be barren, the emptiest of
+  //  them are filled first
+  const size_t num_productive = std::max<size_t>(num_tiles - num_barren, 1);
+  const unsigned int points_per_tile = (num_points + num_productive - 1) / num_productive;
+  const size_t num_searched = std::min(tile_budget, num_tiles);
 
-  std::vector<cv::Point2f> found_points;
-  goodFeaturesToTrack(frame, found_points, num_points * 2, 0.00001, min_distance);
+  std::iota(tiles.order.begin(), tiles.order.end(), 0);
+  std::partial_sort(tiles.order.begin(), tiles.order.begin() + num_searched, tiles.order.end(), [&](size_t a, size_t b)
+  {
+    bool a_barren = tiles.cooldowns[a] > 0;
+    bool b_barren = tiles.cooldowns[b] > 0;
+    return a_barren != b_barren ? b_barren : tiles.counts[a] < tiles.counts[b];
+  });
 
-  for (const auto& pt : found_points)
+  for (size_t i = 0; i < num_searched && points.size() < num_points; ++i)
   {
-    if (points.size() >= num_points)
+    size_t tile_index = tiles.order[i];
+    if (tiles.cooldowns[tile_index] > 0 || tiles.counts[tile_index] >= points_per_tile)
     {
       break;
     }
 
-    bool point_ok = true;
-    for (const auto& f_pt : points) // This should be done based on a map rendering and not in n2 complexity!
+    size_t missing = std::min<size_t>(points_per_tile - tiles.counts[tile_index], num_points - points.size());
+
+    cv::Rect core = tiles.tile(tile_index);
+    cv::Rect search = cv::Rect(core.x - detection_tile_margin, core.y - detection_tile_margin,
+      core.width + 2 * detection_tile_margin, core.height + 2 * detection_tile_margin) & cv::Rect(0, 0, frame.cols, frame.rows);
+
+    if (search.width <= 2 * detection_tile_margin || search.height <= 2 * detection_tile_margin)
     {
-      if (distanceSquared(pt, f_pt) < min_distance_sq)
-      {
-        point_ok = false;
-        break;
-      }
+      continue;
     }
-    if (point_ok)
+
+    detector.detect(frame(search), missing * 2, OpticFlowTracker::min_corner_distance, found_points);
+    if (found_points.empty())
     {
-      points.emplace_back(pt);
+      tiles.cooldowns[tile_index] = barren_tile_cooldown;
+      continue;
     }
+
+    addCorners(found_points, cv::Point2f(search.x, search.y) + offset, missing, points, grid);
+  }
+
+  // The best of the remaining corners of the whole region, away from the points already tracked
+  if (points.size() >= num_points || tiles.region_cooldown > 0)
+  {
+    return;
+  }
+
+  const int exclusion_radius = static_cast<int>(std::ceil(OpticFlowTracker::min_corner_distance));
+  tiles.region_mask.create(frame.size(), CV_8UC1);
+  tiles.region_mask.setTo(255);
+  for (const auto& pt : points)
+  {
+    cv::circle(tiles.region_mask, pt - offset, exclusion_radius, 0, cv::FILLED);
   }
 
-  return points;
+  size_t missing = num_points - points.size();
+  detector.detect(frame, missing, OpticFlowTracker::min_corner_distance, found_points, tiles.region_mask);
+  if (addCorners(found_points, offset, missing, points, grid) == 0)
+  {
+    tiles.region_cooldown = barren_tile_cooldown;
+  }
+}
+
+// The region of interest in the coordinates of a pyramid built at <scale>.
+static Rect<unsigned int> scaleRoi(const Rect<unsigned int>& roi, double scale)
+{
+  return Rect<unsigned int>(roi.start_x * scale, roi.start_y * scale, roi.end_x * scale, roi.end_y * scale);
+}
+
+// Refines the reduced resolution results at full resolution, starting from the scaled up positions.
+//  Points for which the refinement fails keep their reduced resolution result.
+static void refineAtFullResolution(const FramePyramid& prev, const FramePyramid& next,
+  const std::vector<cv::Point2f>& start_points, std::vector<cv::Point2f>& tracked_points, const std::vector<uchar>& status,
+  std::vector<cv::Point2f>& full_start, std::vector<cv::Point2f>& full_tracked, std::vector<uchar>& refined)
+{
+  full_start.clear();
+  full_tracked.clear();
+  for (size_t i = 0; i < start_points.size(); ++i)
+  {
+    full_start.push_back(prev.toFullResolution(start_points[i]));
+    full_tracked.push_back(next.toFullResolution(tracked_points[i]));
+  }
+
+  cv::TermCriteria criteria = cv::TermCriteria((cv::TermCriteria::COUNT) + (cv::TermCriteria::EPS), 10, 0.02);
+  cv::calcOpticalFlowPyrLK(prev.fullLevels(), next.fullLevels(), full_start, full_tracked, refined, cv::noArray(),
+    cv::Size(next.refineWindow(), next.refineWindow()), 0, criteria, cv::OPTFLOW_USE_INITIAL_FLOW);
+
+  for (size_t i = 0; i < tracked_points.size(); ++i)
+  {
+    if (status[i] && refined[i])
+    {
+      tracked_points[i] = next.toReducedResolution(full_tracked[i]);
+    }
+  }
 }
 
 struct OpticFlowTracker::Internal
 {
-  Frame last_frame;
-  std::vector<cv::Point2f> last_points;
+  Internal(const Rect<unsigned int>& roi, size_t num_points, FeatureDetector::Type detector_type)
+    : budget{num_points, OpticFlowTracker::window_size, 1}
+    , detector(createFeatureDetector(detector_type))
+    , tracked_roi(roi)
+    , grid(cv::Rect2f(roi.start_x, roi.start_y, roi.end_x - roi.start_x, roi.end_y - roi.start_y), OpticFlowTracker::min_corner_distance)
+    , tiles(cv::Size(roi.end_x - roi.start_x, roi.end_y - roi.start_y))
+  {}
+
+  TrackingBudget budget;
+  unsigned int frames_since_detection = 0;
+  std::unique_ptr<FeatureDetector> detector;
+
+  const Rect<unsigned int> tracked_roi; // The region of interest on the (possibly downscaled) pyramids
+
+  std::shared_ptr<const FramePyramid> last_pyramid;
+  std::vector<cv::Point2f> last_points; // Pyramid frame coordinates
+  PointGrid grid;                       // Index of last_points
+  DetectionTiles tiles;
+  LkEngine engine = LkEngine::OpenCV;
+  ThreadPool* workers = nullptr;
+
+  // Scratch buffers, kept between frames so that their capacity is reused.
+  std::vector<cv::Point2f> corner_candidates;
+  std::vector<cv::Point2f> tracked_points;
+  std::vector<cv::Point2f> found_points;
+  std::vector<uchar> status_values;
+  std::vector<cv::Point2f> full_start_points;
+  std::vector<cv::Point2f> full_tracked_points;
+  std::vector<uchar> refined_values;
 };
 
-OpticFlowTracker::OpticFlowTracker(const Frame& start_frame, Rect<unsigned int> roi, size_t num_points)
+OpticFlowTracker::OpticFlowTracker(std::shared_ptr<const FramePyramid> start_pyramid, Rect<unsigned int> roi, size_t num_points,
+  FeatureDetector::Type detector)
   : roi(roi)
-    , num_tracked_points(num_points)
-    , internal_(std::make_unique<Internal>())
+    , internal_(std::make_unique<Internal>(scaleRoi(roi, start_pyramid->scale()), num_points, detector))
 {
-  internal_->last_frame = start_frame.crop(roi);
-  internal_->last_points = findCorners(internal_->last_frame.data(), num_tracked_points);
+  internal_->last_pyramid = std::move(start_pyramid);
+
+  const auto& tracked_roi = internal_->tracked_roi;
+  cv::Point2f offset(tracked_roi.start_x, tracked_roi.start_y);
+  // The initial search covers every tile
+  findCorners(*internal_->detector, internal_->last_pyramid->frame().crop(tracked_roi).data(), offset, num_points, internal_->tiles.counts.size(),
+    internal_->last_points, internal_->grid, internal_->tiles, internal_->corner_candidates);
 }
 
 OpticFlowTracker::~OpticFlowTracker() = default;
 
-std::vector<OpticFlow> OpticFlowTracker::calculate(const class Frame & frame)
+void OpticFlowTracker::setEngine(LkEngine engine)
+{
+  internal_->engine = engine;
+}
+
+void OpticFlowTracker::setWorkers(ThreadPool* workers)
 {
-  Frame cropped_frame = frame.crop(roi);
+  internal_->workers = workers;
+}
+
+void OpticFlowTracker::setBudget(const TrackingBudget& budget)
+{
+  internal_->budget = budget;
+  internal_->budget.window_size = std::min(budget.window_size, window_size);
+  internal_->budget.detection_interval = std::max(budget.detection_interval, 1u);
 
-  if (!internal_->last_frame.isCompatible(cropped_frame.data()))
+  auto& points = internal_->last_points;
+  if (points.size() > budget.num_points)
   {
-    return {};
+    for (size_t i = budget.num_points; i < points.size(); ++i)
+    {
+      internal_->grid.erase(points[i]);
+    }
+    points.resize(budget.num_points);
   }
+}
+
+void OpticFlowTracker::setDetector(FeatureDetector::Type type)
+{
+  internal_->detector = createFeatureDetector(type);
+}
 
-  auto start_points = findCorners(cropped_frame.data(), num_tracked_points, internal_->last_points);
+const TrackingBudget& OpticFlowTracker::budget() const
+{
+  return internal_->budget;
+}
 
-  if (start_points.size() == 0)
+size_t OpticFlowTracker::numPoints() const
+{
+  return internal_->last_points.size();
+}
+
+FlowBatch OpticFlowTracker::calculate(const std::shared_ptr<const FramePyramid>& pyramid)
+{
+  FlowBatch optic_flow_vectors;
+  calculate(pyramid, optic_flow_vectors);
+  return optic_flow_vectors;
+}
+
+void OpticFlowTracker::calculate(const std::shared_ptr<const FramePyramid>& pyramid, FlowBatch& optic_flow_vectors)
+{
+  tracing::Span span("OpticFlowTracker::calculate");
+  optic_flow_vectors.clear();
+
+  const auto& tracked_roi = internal_->tracked_roi;
+  Frame cropped_frame = pyramid->frame().crop(tracked_roi);
+
+  if (!cropped_frame.valid() || !internal_->last_pyramid->frame().isCompatible(pyramid->frame()) ||
+      internal_->last_pyramid->scale() != pyramid->scale())
   {
-    return {};
+    internal_->last_pyramid = pyramid;
+    internal_->last_points.clear();
+    internal_->grid.clear();
+    return;
   }
 
-  std::vector<uchar> status_values;
-  std::vector<float> err;
+  cv::Point2f offset(tracked_roi.start_x, tracked_roi.start_y);
 
-  std::vector<cv::Point2f> tracked_points;
+  const auto& budget = internal_->budget;
+
+  auto& start_points = internal_->last_points;
+  if (++internal_->frames_since_detection >= budget.detection_interval)
+  {
+    findCorners(*internal_->detector, cropped_frame.data(), offset, budget.num_points, detection_tiles_per_frame,
+      start_points, internal_->grid, internal_->tiles, internal_->corner_candidates);
+    internal_->frames_since_detection = 0;
+  }
 
+  if (start_points.size() == 0)
+  {
+    return;
+  }
+
+  auto& status_values = internal_->status_values;
+  auto& tracked_points = internal_->tracked_points;
+
+  // Both pyramids are shared with the other trackers, and are only read here.
   cv::TermCriteria criteria = cv::TermCriteria((cv::TermCriteria::COUNT) + (cv::TermCriteria::EPS), 20, 0.05);
-  cv::calcOpticalFlowPyrLK(
-    internal_->last_frame.data(), cropped_frame.data(),
-    start_points, tracked_points,
-    status_values, err,
-    cv::Size(30, 30), 1, criteria);
+  auto tracking_start = std::chrono::steady_clock::now();
+  if (internal_->workers != nullptr)
+  {
+    trackPoints(internal_->engine,
+      *internal_->last_pyramid, *pyramid,
+      start_points, tracked_points,
+      status_values,
+      cv::Size(budget.window_size, budget.window_size), pyramid_levels, criteria,
+      *internal_->workers, tracking_chunk_size);
+  }
+  else
+  {
+    trackPoints(internal_->engine,
+      *internal_->last_pyramid, *pyramid,
+      start_points, tracked_points,
+      status_values,
+      cv::Size(budget.window_size, budget.window_size), pyramid_levels, criteria);
+  }
 
-  std::vector<cv::Point2f> found_points;
+  if (internal_->last_pyramid->hasFullLevels() && pyramid->hasFullLevels())
+  {
+    refineAtFullResolution(*internal_->last_pyramid, *pyramid, start_points, tracked_points, status_values,
+      internal_->full_start_points, internal_->full_tracked_points, internal_->refined_values);
+  }
+  metrics::record(metrics::Stage::OpticalFlow, std::chrono::steady_clock::now() - tracking_start);
+
+  auto& found_points = internal_->found_points;
+  found_points.clear();
   found_points.reserve(tracked_points.size());
 
-  std::vector<OpticFlow> optic_flow_vectors;
   optic_flow_vectors.reserve(tracked_points.size());
 
-  double frame_time_difference = std::chrono::duration_cast<std::chrono::microseconds>(frame.stamp() - internal_->last_frame.stamp()).count()/1000000.0;
+  optic_flow_vectors.dt = std::chrono::duration_cast<std::chrono::microseconds>(pyramid->frame().stamp() - internal_->last_pyramid->frame().stamp()).count()/1000000.0;
+
+  // The index is moved over from the start to the tracked positions; points which are lost, or which
+  //  converged onto an already crowded spot, are dropped from it. The flow of a crowded point is
+  //  still a valid measurement, so it is reported all the same.
+  for (const auto& pt : start_points)
+  {
+    internal_->grid.erase(pt);
+  }
+
+  const float cols = cropped_frame.data().cols;
+  const float rows = cropped_frame.data().rows;
 
   for (size_t index = 0; index < status_values.size(); ++index)
   {
     if (status_values[index] == 1)
     {
-      int start_x = internal_->last_points[index].x;
-      int start_y = internal_->last_points[index].y;
-      int end_x = tracked_points[index].x;
-      int end_y = tracked_points[index].y;
+      float start_x = start_points[index].x - offset.x;
+      float start_y = start_points[index].y - offset.y;
+      float end_x = tracked_points[index].x - offset.x;
+      float end_y = tracked_points[index].y - offset.y;
 
       if (start_x <= 0 || start_y <= 0 ||
           end_x <= 0 || end_y <= 0 ||
-          start_x >= cropped_frame.data().cols || end_x >= cropped_frame.data().cols ||
-          start_y >= cropped_frame.data().rows || end_y >= cropped_frame.data().rows)
+          start_x >= cols || end_x >= cols ||
+          start_y >= rows || end_y >= rows)
       {
         continue;
       }
 
-        optic_flow_vectors.emplace_back(
-          Point2i(start_x, start_y),
-          Point2i(end_x, end_y),
-          frame_time_difference
-        );
-      found_points.emplace_back(tracked_points[index]);
+      // The flow is reported in full frame coordinates, at full resolution
+      cv::Point2f start = internal_->last_pyramid->toFullResolution(start_points[index]);
+      cv::Point2f end = pyramid->toFullResolution(tracked_points[index]);
+      optic_flow_vectors.add(start.x, start.y, end.x, end.y);
+
+      if (internal_->grid.insert(tracked_points[index]))
+      {
+        found_points.emplace_back(tracked_points[index]);
+      }
     }
   }
 
   internal_->last_points.swap(found_points);
-  internal_->last_frame = std::move(cropped_frame);
-
-  return optic_flow_vectors;
-}
\ No newline at end of file
+  internal_->last_pyramid = pyramid;
+}
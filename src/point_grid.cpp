@@ -0,0 +1,95 @@
+#include <motion_tracker/point_grid.h>
+#include <cmath>
+#include <algorithm>
+
+PointGrid::PointGrid(const cv::Rect2f& area, float min_distance)
+  : area_(area)
+  , min_distance_sq_(min_distance * min_distance)
+  , inv_cell_size_(1.0f / min_distance)
+  , columns_(std::max(1, static_cast<int>(std::ceil(area.width / min_distance))))
+  , rows_(std::max(1, static_cast<int>(std::ceil(area.height / min_distance))))
+  , cells_(columns_ * rows_)
+  , size_(0)
+{
+}
+
+void PointGrid::clear()
+{
+  for (auto& cell : cells_)
+  {
+    cell.count = 0;
+  }
+  size_ = 0;
+}
+
+bool PointGrid::contains(const cv::Point2f& pt) const
+{
+  return pt.x >= area_.x && pt.y >= area_.y && pt.x < area_.x + area_.width && pt.y < area_.y + area_.height;
+}
+
+bool PointGrid::insert(const cv::Point2f& pt)
+{
+  if (!contains(pt))
+  {
+    return false;
+  }
+
+  auto& cell = cells_[row(pt.y) * columns_ + column(pt.x)];
+  if (cell.count == cell_capacity)
+  {
+    return false;
+  }
+
+  cell.points[cell.count++] = pt;
+  ++size_;
+  return true;
+}
+
+void PointGrid::erase(const cv::Point2f& pt)
+{
+  if (!contains(pt))
+  {
+    return;
+  }
+
+  auto& cell = cells_[row(pt.y) * columns_ + column(pt.x)];
+  for (uint8_t i = 0; i < cell.count; ++i)
+  {
+    if (cell.points[i] == pt)
+    {
+      cell.points[i] = cell.points[--cell.count];
+      --size_;
+      return;
+    }
+  }
+}
+
+bool PointGrid::hasNeighbour(const cv::Point2f& pt) const
+{
+  int pt_column = column(pt.x);
+  int pt_row = row(pt.y);
+
+  for (int r = std::max(0, pt_row - 1); r <= std::min(rows_ - 1, pt_row + 1); ++r)
+  {
+    for (int c = std::max(0, pt_column - 1); c <= std::min(columns_ - 1, pt_column + 1); ++c)
+    {
+      const auto& cell = cells_[r * columns_ + c];
+      for (uint8_t i = 0; i < cell.count; ++i)
+      {
+        float dx = cell.points[i].x - pt.x;
+        float dy = cell.points[i].y - pt.y;
+        if (dx * dx + dy * dy < min_distance_sq_)
+        {
+          return true;
+        }
+      }
+    }
+  }
+
+  return false;
+}
+
+bool PointGrid::tryInsert(const cv::Point2f& pt)
+{
+  return contains(pt) && !hasNeighbour(pt) && insert(pt);
+}
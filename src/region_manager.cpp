@@ -0,0 +1,152 @@
+#include <motion_tracker/region_manager.h>
+#include <algorithm>
+
+static Frame::TimeStamp::duration periodOf(const TrackedRegion& region)
+{
+  if (region.rate <= 0)
+  {
+    return Frame::TimeStamp::duration::zero();
+  }
+  return std::chrono::duration_cast<Frame::TimeStamp::duration>(std::chrono::duration<double>(1.0 / region.rate));
+}
+
+RegionManager::RegionManager(const std::shared_ptr<const FramePyramid>& start_pyramid, std::vector<TrackedRegion> regions, ThreadPool& workers,
+  FeatureDetector::Type detector)
+  : regions_(std::move(regions))
+  , workers_(workers)
+  , last_stamp_(start_pyramid->frame().stamp())
+{
+  for (const auto& region : regions_)
+  {
+    trackers_.push_back(std::make_unique<OpticFlowTracker>(start_pyramid, region.roi, region.num_points, detector));
+    trackers_.back()->setWorkers(&workers_);
+    next_due_.push_back(last_stamp_ + periodOf(region));
+  }
+}
+
+RegionManager::~RegionManager() = default;
+
+void RegionManager::setEngine(LkEngine engine)
+{
+  for (auto& tracker : trackers_)
+  {
+    tracker->setEngine(engine);
+  }
+}
+
+void RegionManager::setDetector(FeatureDetector::Type type)
+{
+  for (auto& tracker : trackers_)
+  {
+    tracker->setDetector(type);
+  }
+}
+
+size_t RegionManager::totalPoints() const
+{
+  size_t total = 0;
+  for (const auto& region : regions_)
+  {
+    total += region.num_points;
+  }
+  return total;
+}
+
+void RegionManager::setBudget(const TrackingBudget& budget)
+{
+  double point_share = static_cast<double>(budget.num_points) / std::max<size_t>(totalPoints(), 1);
+  for (size_t i = 0; i < regions_.size(); ++i)
+  {
+    TrackingBudget region_budget = budget;
+    region_budget.num_points = std::min(regions_[i].num_points, static_cast<size_t>(regions_[i].num_points * point_share + 0.5));
+    trackers_[i]->setBudget(region_budget);
+  }
+}
+
+// A region with a rate is tracked on the frame closest to the time it is due next, and then due a
+//  period later, so it keeps its rate on average whatever the frame rate is.
+bool RegionManager::isDue(size_t index, const Frame::TimeStamp& stamp)
+{
+  const auto& region = regions_[index];
+  if ((frame_count_ % std::max(region.decimation, 1u)) != 0)
+  {
+    return false;
+  }
+  if (region.rate <= 0)
+  {
+    return true;
+  }
+
+  auto half_frame = (stamp - last_stamp_) / 2;
+  auto period = periodOf(region);
+  auto& next_due = next_due_[index];
+  if (stamp + half_frame < next_due)
+  {
+    return false;
+  }
+
+  // After a stall the schedule restarts rather than catching up on the missed periods
+  next_due = stamp - next_due > period ? stamp + period : next_due + period;
+  return true;
+}
+
+void RegionManager::track(const std::shared_ptr<const FramePyramid>& pyramid, Flows& flows)
+{
+  flows.regions.resize(regions_.size());
+  flows.rotation.clear();
+  flows.translation.clear();
+  flows.rotation_tracked = false;
+  flows.translation_tracked = false;
+
+  const auto& stamp = pyramid->frame().stamp();
+  due_.clear();
+  for (size_t i = 0; i < regions_.size(); ++i)
+  {
+    if (isDue(i, stamp))
+    {
+      due_.push_back(i);
+    }
+  }
+  ++frame_count_;
+  last_stamp_ = stamp;
+
+  if (due_.empty())
+  {
+    return;
+  }
+
+  // The first region is tracked on the calling thread, which would otherwise only wait for the others
+  tasks_.clear();
+  done_.clear();
+  for (size_t i = 1; i < due_.size(); ++i)
+  {
+    tasks_.push_back(trackers_[due_[i]]->packageCalculation(pyramid, flows.regions[due_[i]]));
+    done_.push_back(tasks_.back().get_future());
+  }
+  for (auto& task : tasks_)
+  {
+    workers_.addWork([&task](){ task(); });
+  }
+
+  trackers_[due_.front()]->calculate(pyramid, flows.regions[due_.front()]);
+
+  for (auto& done : done_)
+  {
+    done.wait();
+  }
+
+  for (size_t index : due_)
+  {
+    auto role = regions_[index].role;
+    if (role != TrackedRegion::Role::Speed)
+    {
+      flows.rotation.append(flows.regions[index]);
+      flows.rotation_tracked = true;
+    }
+    if (role != TrackedRegion::Role::Yaw)
+    {
+      flows.translation.append(flows.regions[index]);
+      flows.translation_tracked = true;
+    }
+  }
+}
@@ -0,0 +1,214 @@
+#include <motion_tracker/tracing.h>
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+namespace tracing
+{
+
+static constexpr size_t ring_capacity = 16384; // Spans kept per thread
+
+// Written by its thread only. The readers copy the spans concurrently, and drop the ones the writer
+//  may have overwritten while they were copied.
+struct Ring
+{
+  struct Event
+  {
+    std::atomic<const char*> name{nullptr};
+    std::atomic<int64_t> start{0};    // [ns] on the steady clock
+    std::atomic<int64_t> duration{0}; // [ns]
+  };
+
+  std::array<Event, ring_capacity> events;
+  std::atomic<uint64_t> written{0};
+
+  size_t id = 0;
+  std::string thread_name; // Guarded by the registry's lock
+};
+
+// The rings are kept after their threads exit, so their last spans still show up in the traces.
+struct Registry
+{
+  std::mutex lock;
+  std::vector<std::unique_ptr<Ring>> rings;
+};
+
+static Registry& registry()
+{
+  static Registry instance;
+  return instance;
+}
+
+// A thread only gets a ring once it records its first span, so threads named while tracing is
+//  disabled do not allocate one. Their name is kept until then.
+static thread_local Ring* local_ring = nullptr;
+static thread_local std::string local_thread_name;
+
+static Ring& localRing()
+{
+  if (local_ring == nullptr)
+  {
+    auto& rings = registry();
+    std::lock_guard<std::mutex> _(rings.lock);
+    rings.rings.push_back(std::make_unique<Ring>());
+    local_ring = rings.rings.back().get();
+    local_ring->id = rings.rings.size();
+    local_ring->thread_name = local_thread_name;
+  }
+  return *local_ring;
+}
+
+static int64_t nanoseconds(std::chrono::steady_clock::time_point time)
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+const char* intern(const std::string& name)
+{
+  static std::mutex lock;
+  static std::unordered_set<std::string> names;
+
+  std::lock_guard<std::mutex> _(lock);
+  return names.insert(name).first->c_str();
+}
+
+void setEnabled(bool enabled)
+{
+  detail::enabled.store(enabled, std::memory_order_relaxed);
+}
+
+void setThreadName(const std::string& name)
+{
+  local_thread_name = name;
+  if (local_ring != nullptr)
+  {
+    std::lock_guard<std::mutex> _(registry().lock);
+    local_ring->thread_name = name;
+  }
+}
+
+void record(const char* name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+{
+  auto& ring = localRing();
+  uint64_t index = ring.written.load(std::memory_order_relaxed);
+  auto& event = ring.events[index % ring_capacity];
+
+  // Keeps the slot's stores from becoming visible before the previous span's count, as the readers
+  //  rely on the count to tell the overwritten slots
+  std::atomic_thread_fence(std::memory_order_release);
+  event.name.store(name, std::memory_order_relaxed);
+  event.start.store(nanoseconds(start), std::memory_order_relaxed);
+  event.duration.store(nanoseconds(end) - nanoseconds(start), std::memory_order_relaxed);
+  ring.written.store(index + 1, std::memory_order_release);
+}
+
+static void appendEscaped(std::string& json, const std::string& text)
+{
+  for (char c : text)
+  {
+    if (c == '"' || c == '\\')
+    {
+      json += '\\';
+    }
+    json += c;
+  }
+}
+
+std::string chromeTraceJson()
+{
+  struct Copy
+  {
+    const char* name;
+    int64_t start;
+    int64_t duration;
+  };
+
+  struct ThreadCopy
+  {
+    size_t id;
+    std::string name;
+    std::vector<Copy> spans;
+  };
+  std::vector<ThreadCopy> threads;
+
+  // Only the spans are copied under the lock, so the threads starting to trace do not wait for the
+  //  formatting
+  {
+    auto& rings = registry();
+    std::lock_guard<std::mutex> _(rings.lock);
+    threads.reserve(rings.rings.size());
+    for (const auto& ring : rings.rings)
+    {
+      uint64_t written = ring->written.load(std::memory_order_acquire);
+      uint64_t begin = written > ring_capacity ? written - ring_capacity : 0;
+
+      threads.push_back({ring->id, ring->thread_name, {}});
+      auto& copies = threads.back().spans;
+      copies.reserve(written - begin);
+      for (uint64_t i = begin; i < written; ++i)
+      {
+        const auto& event = ring->events[i % ring_capacity];
+        copies.push_back({event.name.load(std::memory_order_relaxed), event.start.load(std::memory_order_relaxed),
+          event.duration.load(std::memory_order_relaxed)});
+      }
+
+      // The slots the writer got to since are overwritten, possibly halfway, and so may be the one it
+      //  is writing right now
+      std::atomic_thread_fence(std::memory_order_acquire);
+      uint64_t overwritten = ring->written.load(std::memory_order_relaxed) + 1;
+      uint64_t valid_begin = overwritten > ring_capacity ? overwritten - ring_capacity : 0;
+      copies.erase(copies.begin(), copies.begin() + (std::min(std::max(begin, valid_begin), written) - begin));
+    }
+  }
+
+  std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  bool first = true;
+  char buffer[256];
+
+  for (const auto& thread : threads)
+  {
+    if (!thread.name.empty())
+    {
+      json += first ? "" : ",";
+      first = false;
+      snprintf(buffer, sizeof(buffer), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"", thread.id);
+      json += buffer;
+      appendEscaped(json, thread.name);
+      json += "\"}}";
+    }
+
+    for (const auto& copy : thread.spans)
+    {
+      json += first ? "" : ",";
+      first = false;
+      json += "{\"name\":\"";
+      appendEscaped(json, copy.name);
+      snprintf(buffer, sizeof(buffer), "\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f}",
+        thread.id, copy.start / 1000.0, copy.duration / 1000.0);
+      json += buffer;
+    }
+  }
+
+  json += "]}";
+  return json;
+}
+
+bool dump(const std::string& path)
+{
+  std::ofstream file(path);
+  if (!file.is_open())
+  {
+    printf("Failed to open %s for the trace!\n", path.c_str());
+    return false;
+  }
+
+  file << chromeTraceJson();
+  return file.good();
+}
+
+}
@@ -0,0 +1,75 @@
+#include <motion_tracker/tracking_budget.h>
+#include <algorithm>
+
+static constexpr double frame_time_smoothing = 0.2;
+
+// Frames for the smoothed time to reflect a budget change
+static constexpr unsigned int settle_period = 5;
+
+// The budget is only increased if the frames are faster than this fraction of the target for a while
+static constexpr double recovery_load = 0.7;
+static constexpr unsigned int recovery_frames = 30;
+
+static std::vector<TrackingBudget> buildLevels(const TrackingBudget& full)
+{
+  auto points = [&](double fraction) { return std::max<size_t>(static_cast<size_t>(full.num_points * fraction), 1); };
+  auto window = [&](int size) { return std::min(full.window_size, size); };
+  auto interval = [&](unsigned int frames) { return std::max(full.detection_interval, frames); };
+
+  return {
+    full,
+    {points(0.8),  full.window_size, full.detection_interval},
+    {points(0.6),  window(21),       full.detection_interval},
+    {points(0.6),  window(21),       interval(2)},
+    {points(0.4),  window(15),       interval(2)},
+    {points(0.4),  window(15),       interval(4)},
+    {points(0.25), window(15),       interval(4)},
+  };
+}
+
+BudgetController::BudgetController(Duration target_period, const TrackingBudget& full_budget)
+  : target_period_(std::chrono::duration<double>(target_period).count())
+  , levels_(buildLevels(full_budget))
+  , level_(0)
+  , smoothed_time_(0)
+  , settle_frames_(0)
+  , fast_frames_(0)
+{
+}
+
+const TrackingBudget& BudgetController::update(Duration frame_time)
+{
+  double time = std::chrono::duration<double>(frame_time).count();
+  smoothed_time_ = (smoothed_time_ == 0) ? time : smoothed_time_ + frame_time_smoothing * (time - smoothed_time_);
+
+  if (settle_frames_ > 0)
+  {
+    --settle_frames_;
+    return budget();
+  }
+
+  if (smoothed_time_ > target_period_)
+  {
+    fast_frames_ = 0;
+    if (level_ < maxDegradationLevel())
+    {
+      ++level_;
+      settle_frames_ = settle_period;
+    }
+  }
+  else if (smoothed_time_ < recovery_load * target_period_)
+  {
+    if (++fast_frames_ >= recovery_frames && level_ > 0)
+    {
+      --level_;
+      fast_frames_ = 0;
+      settle_frames_ = settle_period;
+    }
+  }
+  else
+  {
+    fast_frames_ = 0;
+  }
+
+  return budget();
+}
@@ -3,6 +3,8 @@
 #include <sys/stat.h>
 
 #include <motion_tracker/web_viewer.h>
+#include <motion_tracker/metrics.h>
+#include <motion_tracker/tracing.h>
 #include <crow/app.h>
 
 #include <opencv2/opencv.hpp>
@@ -116,6 +118,7 @@ void WebViewer::run(unsigned int port)
 
   updater_ = std::thread([&]()
         {
+          tracing::setThreadName("viewer");
           while (running_)
           {
             std::unique_lock<std::mutex> lock(frame_lock_);
@@ -213,6 +216,26 @@ WebViewer::WebViewer(std::string ext_interface_name)
 //                 });
 
 
+  // Latency histograms of the processing stages, for Prometheus to scrape
+  CROW_ROUTE((*app_), "/metrics")
+    .methods("GET"_method)
+      ([]()
+         {
+           crow::response response(metrics::prometheusText());
+           response.set_header("Content-Type", "text/plain; version=0.0.4");
+           return response;
+         });
+
+  // The spans recorded so far, to be opened in chrome://tracing or ui.perfetto.dev
+  CROW_ROUTE((*app_), "/trace")
+    .methods("GET"_method)
+      ([]()
+         {
+           crow::response response(tracing::chromeTraceJson());
+           response.set_header("Content-Type", "application/json");
+           return response;
+         });
+
   CROW_ROUTE((*app_),"/<string>")
     .methods("GET"_method)
     ([interface_addr](const std::string& resource){
@@ -241,11 +264,15 @@ void WebViewer::updateFrame(const cv::Mat& frame, const std::unordered_map<std::
 
 void WebViewer::updateClients(const WSFrame& stash)
 {
+  tracing::Span span("WebViewer::updateClients");
   cv::Mat small_img = stash.frame;
   // cv::resize(stash.frame, small_img, cv::Size(0, 0), 0.5, 0.5, cv::INTER_NEAREST);
 
   std::vector<uchar> image_buffer;
-  cv::imencode(".jpeg", small_img, image_buffer, {cv::IMWRITE_JPEG_QUALITY, 30});
+  {
+    metrics::ScopedLatency latency(metrics::Stage::JpegEncode);
+    cv::imencode(".jpeg", small_img, image_buffer, {cv::IMWRITE_JPEG_QUALITY, 30});
+  }
 
   auto img_base64 = base64_encode(image_buffer.data(), image_buffer.size());
 